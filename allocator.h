@@ -23,7 +23,9 @@
  * or false otherwise. The myinit function can be called to reset
  * the heap to an empty state. When running against a set of
  * of test scripts, our test harness calls myinit before starting
- * each new script.
+ * each new script. The segment may be any writable memory: what it
+ * held is overwritten only where the heap puts blocks and their
+ * headers, and nothing in it is taken to read as zero.
  */
 bool myinit(void *segment_start, size_t segment_size);
 
@@ -48,6 +50,168 @@ void *myrealloc(void *ptr, size_t new_size);
 void myfree(void *ptr);
 
 
+/* Function: mycalloc
+ * ------------------
+ * Custom version of calloc: count objects of size bytes, all zero.
+ * Only the explicit allocator provides this. It only clears the bytes
+ * that may be dirty, so memory fresh from the system is never touched.
+ */
+void *mycalloc(size_t count, size_t size);
+
+
+/* Function: mymemalign
+ * --------------------
+ * Allocates size bytes at an address that is a multiple of alignment,
+ * which must be a power of two. The free space in front of the block
+ * is kept as a free block rather than wasted. The block can be passed
+ * to myfree and myrealloc like any other, though a realloc that moves
+ * it only keeps ALIGNMENT. The implicit and explicit allocators
+ * provide this.
+ */
+void *mymemalign(size_t alignment, size_t size);
+
+
+/* Function: mymalloc_batch
+ * ------------------------
+ * Allocates n blocks of size bytes into out, as n calls to mymalloc
+ * would, but takes the heap lock once and cuts the blocks from as few
+ * free blocks as it can. Returns how many it allocated, fewer than n
+ * only if the heap is full. Only the explicit allocator provides this.
+ */
+size_t mymalloc_batch(size_t size, size_t n, void *out[]);
+
+
+/* Function: myfree_batch
+ * ----------------------
+ * Frees the n blocks in ptrs, as n calls to myfree would; null pointers
+ * are skipped. Blocks next to each other in memory are merged before
+ * they are freed. The array is used as scratch space and is left in no
+ * particular order. Only the explicit allocator provides this.
+ */
+void myfree_batch(void *ptrs[], size_t n);
+
+
+/* Functions: myregion_begin, myregion_alloc, myregion_mark,
+ *            myregion_reset, myregion_release
+ * ------------------------------------------------------------
+ * A region reserves one block with room for size bytes of objects.
+ * myregion_alloc cuts objects off it in order, aligned to ALIGNMENT,
+ * with no header or lock, and returns NULL once it is full. Objects
+ * are never passed to myfree or myrealloc. myregion_reset frees every
+ * object allocated after a checkpoint from myregion_mark, or all of
+ * them for NULL, and keeps the block. myregion_release frees the block
+ * and all of its objects in one go. A region belongs to one thread at
+ * a time. Only the explicit allocator provides this.
+ */
+typedef struct region region;
+
+region *myregion_begin(size_t size);
+void *myregion_alloc(region *r, size_t size);
+void *myregion_mark(region *r);
+bool myregion_reset(region *r, void *mark);
+void myregion_release(region *r);
+
+
+/* Function: myinit_arenas
+ * -----------------------
+ * Like myinit, but splits the segment into narenas independent heaps,
+ * each with its own lock, so threads allocating in different arenas do
+ * not contend. Threads are assigned to arenas round-robin. Only the
+ * explicit allocator provides this.
+ */
+bool myinit_arenas(void *segment_start, size_t segment_size, int narenas);
+
+
+/* Function: myinit_anonymous
+ * --------------------------
+ * Like myinit_arenas, for a segment the client mapped MAP_PRIVATE |
+ * MAP_ANONYMOUS. It discards the segment's contents, giving its pages
+ * back with madvise, so that mycalloc need not clear blocks from pages
+ * the heap has not written to since and free pages can be given back
+ * while the heap runs. It must not be used for shared or file-backed
+ * memory. Only the explicit allocator provides this.
+ */
+bool myinit_anonymous(void *segment_start, size_t segment_size, int narenas);
+
+
+// size_hist classes: requests of up to 8, 16, 32, ... bytes, the last taking all larger ones
+#define STATS_SIZE_CLASSES 28
+
+/* Filled in by mystats. The first five fields are always kept; the
+ * rest are only counted when the allocator is built with HEAP_STATS
+ * defined (make STATS=1) and are zero otherwise. Counts run from the
+ * last myinit.
+ */
+typedef struct {
+    size_t bytes_in_use;       // payload bytes of allocated blocks
+    size_t peak_footprint;     // furthest into the segment the heap has reached, plus chunks added
+    size_t num_blocks;         // blocks in the heap, allocated or free
+    size_t mapped_bytes;       // payload bytes of blocks mapped outside the segment
+    size_t num_mapped;         // those blocks
+
+    size_t peak_bytes_in_use;  // the most bytes_in_use has been at one moment
+    unsigned long mallocs;     // calls to mymalloc, and myrealloc of NULL
+    unsigned long frees;       // calls to myfree with a block, and myrealloc to 0
+    unsigned long reallocs;    // calls to myrealloc that resize a block
+    unsigned long failed;      // requests that returned NULL
+    unsigned long searches;    // free-list searches for a fitting block
+    unsigned long search_steps; // blocks looked at by those searches
+    unsigned long splits;      // blocks split to hand out part of them
+    unsigned long coalesces;   // free blocks merged with a neighbor
+    unsigned long realloc_in_place;
+    unsigned long realloc_moved;
+    size_t realloc_copied;     // payload bytes realloc copied, to a new block or down into the free one before it
+    unsigned long purges;      // madvise calls giving free pages back to the system
+    size_t purged_bytes;       // bytes they gave back
+    unsigned long size_hist[STATS_SIZE_CLASSES]; // malloc and realloc sizes
+} heap_stats;
+
+
+/* Function: mystats
+ * -----------------
+ * Fills in stats for the current heap. Returns true if the detailed
+ * counters were kept (built with HEAP_STATS), false if only the first
+ * fields are meaningful.
+ */
+bool mystats(heap_stats *stats);
+
+
+/* Function: myprofile
+ * -------------------
+ * Starts the sampling heap profiler, which records the call stack of
+ * about one allocation per rate bytes allocated and keeps it until the
+ * block is freed. A rate of 0 stops it. Only the explicit allocator
+ * provides this.
+ */
+bool myprofile(size_t rate);
+
+
+/* Function: myprofile_dump
+ * ------------------------
+ * Writes the call stacks of the sampled blocks still allocated to path
+ * as a heap profile pprof can read. Returns false if it cannot be written.
+ */
+bool myprofile_dump(const char *path);
+
+
+/* Function: mygrows
+ * -----------------
+ * Returns true if the allocator maps more memory once the segment
+ * passed to myinit is full, so a client may start with a small one.
+ * Only the explicit allocator provides this.
+ */
+bool mygrows(void);
+
+
+/* Function: mymapped
+ * -------------------
+ * Returns true if ptr is a block the allocator mapped outside the
+ * segment: a huge block with a mapping of its own, or one in a chunk
+ * the heap grew by. Only the explicit allocator provides this.
+ */
+bool mymapped(void *ptr);
+
+
 /* Function: validate_heap
  * -----------------------
  * This is the hook for your heap consistency checker. Returns true
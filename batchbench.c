@@ -0,0 +1,224 @@
+/*
+ * File: batchbench.c
+ * Replays scripts against the explicit allocator twice, once with one
+ * call per operation and once with runs of operations handed to
+ * mymalloc_batch and myfree_batch, and reports the nanoseconds per
+ * object in those runs for both. A run is up to max_batch consecutive
+ * mallocs of one size, or consecutive frees, as a program that builds
+ * a structure's nodes together and tears them down together makes them.
+ * Both replays read the clock around the same runs; operations outside
+ * runs are replayed one call at a time in both and only count towards
+ * the overall throughput. Each number is the best of several passes,
+ * which alternate between the two replays.
+ *
+ * usage: batchbench_explicit [-n max_batch] [-r repeats] script...
+ */
+#include "allocator.h"
+#include "script.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SEGMENT_SIZE ((size_t)1 << 32) //address space only, pages are touched on use
+
+typedef struct {
+    int first; //index of the run's first operation
+    int count; //at least 2
+} run;
+
+typedef struct {
+    double total_ns; //the whole pass
+    double run_ns; //the runs only
+} pass_times;
+
+static void *segment;
+static double clock_cost; //ns for one pair of clock reads
+static int max_batch = 64;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//This function measures the smallest cost of two back-to-back clock reads.
+double measure_clock_cost(void) {
+    double best = 1e9;
+    for (int i = 0; i < 1000; i++) {
+        double begin = now_ns();
+        double cost = now_ns() - begin;
+        if (cost < best) best = cost;
+    }
+    return best;
+}
+
+/* This function splits s into runs of up to max_batch mallocs of the
+ * same size, or frees, in a row and stores those of two or more
+ * operations in runs; mallocs of 0 bytes are left out. Returns how
+ * many there are.
+ */
+int find_runs(script *s, run *runs) {
+    int num_runs = 0;
+    for (int i = 0; i < s->num_ops;) {
+        script_op *op = &s->ops[i];
+        int count = 1;
+        while (count < max_batch && i + count < s->num_ops) {
+            script_op *next = &s->ops[i + count];
+            if (OP_TYPE(next) != OP_TYPE(op) || OP_TYPE(op) == OP_REALLOC ||
+                (OP_TYPE(op) == OP_MALLOC && (next->size != op->size || op->size == 0))) {
+                break;
+            }
+            count++;
+        }
+        if (count > 1) runs[num_runs++] = (run){i, count};
+        i += count;
+    }
+    return num_runs;
+}
+
+/* This function replays s once on a freshly reset heap, doing each of
+ * the runs with one batch call if batched and with one call per
+ * operation otherwise, and adds the time they took to times. Blocks
+ * left at the end are freed afterwards. Returns false if a request
+ * that should succeed failed.
+ */
+bool replay(script *s, void **blocks, run *runs, int num_runs, bool batched, pass_times *times) {
+    void *ptrs[max_batch];
+    memset(blocks, 0, s->num_ids * sizeof(void *));
+    if (!myinit(segment, SEGMENT_SIZE)) {
+        printf("myinit failed.\n");
+        return false;
+    }
+    double begin_pass = now_ns();
+    int next_run = 0;
+    for (int i = 0; i < s->num_ops;) {
+        script_op *op = &s->ops[i];
+        int type = OP_TYPE(op);
+        if (next_run < num_runs && runs[next_run].first == i) {
+            int count = runs[next_run++].count;
+            double begin = now_ns();
+            if (type == OP_MALLOC && batched) {
+                if (mymalloc_batch(op->size, count, ptrs) != (size_t)count) {
+                    printf("Batch of %d mallocs of %u at operation %d failed.\n", count, op->size, i);
+                    return false;
+                }
+                for (int k = 0; k < count; k++) {
+                    blocks[OP_ID(op + k)] = ptrs[k];
+                }
+            } else if (type == OP_MALLOC) {
+                for (int k = 0; k < count; k++) {
+                    if ((blocks[OP_ID(op + k)] = mymalloc(op->size)) == NULL) {
+                        printf("Malloc of %u at operation %d failed.\n", op->size, i + k);
+                        return false;
+                    }
+                }
+            } else if (batched) {
+                for (int k = 0; k < count; k++) {
+                    ptrs[k] = blocks[OP_ID(op + k)];
+                    blocks[OP_ID(op + k)] = NULL;
+                }
+                myfree_batch(ptrs, count);
+            } else {
+                for (int k = 0; k < count; k++) {
+                    myfree(blocks[OP_ID(op + k)]);
+                    blocks[OP_ID(op + k)] = NULL;
+                }
+            }
+            times->run_ns += now_ns() - begin - clock_cost;
+            i += count;
+            continue;
+        }
+        void **b = &blocks[OP_ID(op)];
+        if (type == OP_FREE) {
+            myfree(*b);
+            *b = NULL;
+        } else {
+            void *ptr = type == OP_MALLOC ? mymalloc(op->size) : myrealloc(*b, op->size);
+            if (ptr == NULL && op->size != 0) {
+                printf("Operation %d (%s %u) failed.\n", i, type == OP_MALLOC ? "malloc" : "realloc", op->size);
+                return false;
+            }
+            *b = ptr;
+        }
+        i++;
+    }
+    times->total_ns += now_ns() - begin_pass;
+    for (int id = 0; id < s->num_ids; id++) {
+        myfree(blocks[id]);
+    }
+    return true;
+}
+
+/* This function benchmarks one script both ways and prints the cost
+ * per object in its runs. Returns false if the allocator failed to
+ * replay it.
+ */
+bool bench_script(const char *path, int repeats) {
+    script s;
+    if (!read_script(path, &s)) return false;
+    void **blocks = malloc((s.num_ids + 1) * sizeof(void *));
+    run *runs = malloc((s.num_ops + 1) * sizeof(run));
+    int num_runs = find_runs(&s, runs);
+    int in_runs[NUM_OP_TYPES] = {0};
+    for (int r = 0; r < num_runs; r++) {
+        in_runs[OP_TYPE(&s.ops[runs[r].first])] += runs[r].count;
+    }
+
+    //the first pass touches the pages the later ones reuse
+    pass_times ignored = {0};
+    bool ok = replay(&s, blocks, runs, num_runs, false, &ignored);
+    pass_times best[2];
+    for (int rep = 0; ok && rep < repeats; rep++) {
+        for (int batched = 0; ok && batched < 2; batched++) {
+            pass_times times = {0};
+            ok = replay(&s, blocks, runs, num_runs, batched, &times);
+            if (rep == 0 || times.run_ns < best[batched].run_ns) best[batched].run_ns = times.run_ns;
+            if (rep == 0 || times.total_ns < best[batched].total_ns) best[batched].total_ns = times.total_ns;
+        }
+    }
+
+    if (ok) {
+        int objects = in_runs[OP_MALLOC] + in_runs[OP_FREE];
+        printf("%s: %d ops, %d mallocs and %d frees in %d runs (%.1f each)\n", path, s.num_ops,
+               in_runs[OP_MALLOC], in_runs[OP_FREE], num_runs, num_runs ? (double)objects / num_runs : 0);
+        for (int batched = 0; batched < 2; batched++) {
+            printf("  %-7s %7.1f ns per object in runs, %.2f Mops/s overall\n", batched ? "batched" : "single",
+                   objects ? best[batched].run_ns / objects : 0, s.num_ops / best[batched].total_ns * 1e3);
+        }
+    }
+    free(runs);
+    free(blocks);
+    free_script(&s);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    int repeats = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        if (opt == 'n') max_batch = atoi(optarg);
+        else if (opt == 'r') repeats = atoi(optarg);
+        else break;
+    }
+    if (optind >= argc || repeats < 1 || max_batch < 2) {
+        printf("usage: %s [-n max_batch] [-r repeats] script...\n", argv[0]);
+        return 1;
+    }
+    segment = mmap(NULL, SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (segment == MAP_FAILED) {
+        printf("Could not map the heap segment.\n");
+        return 1;
+    }
+    clock_cost = measure_clock_cost();
+
+    int status = 0;
+    for (int i = optind; i < argc; i++) {
+        if (!bench_script(argv[i], repeats)) status = 1;
+    }
+    munmap(segment, SEGMENT_SIZE);
+    return status;
+}
@@ -0,0 +1,307 @@
+/*
+ * File: bench.c
+ * Replays scripts against an allocator and reports wall-clock timing:
+ * nanoseconds per malloc, realloc and free (mean, p50, p99, p99.9 and max),
+ * overall throughput, and peak utilization (the most payload live at
+ * once divided by how far into the segment the blocks reached).
+ * Throughput is the best of several untimed passes; the per-operation
+ * numbers come from one more pass that reads the clock around each
+ * call, less the cost of reading the clock.
+ * With -s it also prints the allocator's mystats counters after that
+ * pass, which needs an allocator built with make STATS=1. With -m ops
+ * it prints the process's resident memory every ops operations of that
+ * pass, which starts with the segment's pages given back. Each report
+ * also gives what it grew by since the pass started per live block.
+ * With -c it counts the cache misses of one more untimed pass with the
+ * hardware counters, where the kernel lets it.
+ *
+ * usage: bench_<allocator> [-s] [-c] [-m ops] [-r repeats] script...
+ */
+#include "allocator.h"
+#include "script.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SEGMENT_SIZE ((size_t)1 << 32) //address space only, pages are touched on use
+
+//only the explicit allocator has this, so the benchmark still links without it
+bool myinit_anonymous(void *segment_start, size_t segment_size, int narenas) __attribute__((weak));
+
+static const char *op_names[NUM_OP_TYPES] = {"malloc", "realloc", "free"};
+
+typedef struct {
+    void *ptr;
+    size_t size;
+} block;
+
+typedef struct {
+    double *samples[NUM_OP_TYPES]; //ns per operation of each type
+    int counts[NUM_OP_TYPES];
+    size_t peak_payload;
+    uintptr_t high_water; //end of the highest block handed out
+    bool outside; //a block was not in the segment, so utilization means nothing
+} pass_stats;
+
+static void *segment;
+static double clock_cost; //ns for one pair of clock reads
+static bool show_stats;
+static bool count_misses;
+static int rss_interval; //operations between resident memory reports, 0 for none
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+//This function measures the smallest cost of two back-to-back clock reads.
+double measure_clock_cost(void) {
+    double best = 1e9;
+    for (int i = 0; i < 1000; i++) {
+        double begin = now_ns();
+        double cost = now_ns() - begin;
+        if (cost < best) best = cost;
+    }
+    return best;
+}
+
+//This function returns the resident memory of the process in KB.
+long resident_kb(void) {
+    long pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) return 0;
+    if (fscanf(fp, "%*s %ld", &pages) != 1) pages = 0;
+    fclose(fp);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* This function opens a counter of this thread's cache misses in user
+ * space, stopped and at zero. Returns -1 if there is no such counter,
+ * as in most virtual machines.
+ */
+int open_miss_counter(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* This function resets the heap before a pass, outside the timed part.
+ * The segment is private anonymous memory, so an allocator that can
+ * make use of that is told so.
+ */
+bool reset_heap(void) {
+    bool ok = myinit_anonymous != NULL ? myinit_anonymous(segment, SEGMENT_SIZE, 1)
+                                       : myinit(segment, SEGMENT_SIZE);
+    if (!ok) {
+        printf("myinit failed.\n");
+        return false;
+    }
+    return true;
+}
+
+/* This function replays s once on a freshly reset heap. With stats it reads
+ * the clock around every call and tracks utilization; without, it only
+ * runs the operations. Blocks left at the end are freed afterwards so
+ * the system allocator does not leak across passes. Returns false if
+ * a request that should succeed returned NULL.
+ */
+bool replay(script *s, block *blocks, pass_stats *stats) {
+    memset(blocks, 0, s->num_ids * sizeof(block));
+    size_t live = 0;
+    int live_blocks = 0;
+    long start_kb = stats && rss_interval ? resident_kb() : 0; //the program and the script, before any block
+    for (int i = 0; i < s->num_ops; i++) {
+        script_op *op = &s->ops[i];
+        block *b = &blocks[OP_ID(op)];
+        int type = OP_TYPE(op);
+        double begin = stats ? now_ns() : 0;
+        void *ptr = NULL;
+        if (type == OP_MALLOC) {
+            ptr = mymalloc(op->size);
+        } else if (type == OP_REALLOC) {
+            ptr = myrealloc(b->ptr, op->size);
+        } else myfree(b->ptr);
+        if (stats) {
+            double ns = now_ns() - begin - clock_cost;
+            stats->samples[type][stats->counts[type]++] = ns > 0 ? ns : 0;
+        }
+
+        if (type != OP_FREE && ptr == NULL && op->size != 0) {
+            printf("Operation %d (%s %u %u) failed.\n", i, op_names[type], OP_ID(op), op->size);
+            return false;
+        }
+        live -= b->size;
+        live_blocks += (ptr != NULL) - (b->ptr != NULL);
+        b->ptr = ptr;
+        b->size = ptr ? op->size : 0;
+        live += b->size;
+        if (stats && ptr != NULL) {
+            uintptr_t end = (uintptr_t)ptr + op->size;
+            if ((char *)ptr < (char *)segment || end > (uintptr_t)segment + SEGMENT_SIZE) {
+                stats->outside = true;
+            } else if (end > stats->high_water) stats->high_water = end;
+            if (live > stats->peak_payload) stats->peak_payload = live;
+        }
+        if (stats && rss_interval && (i + 1) % rss_interval == 0) {
+            long kb = resident_kb();
+            printf("  after %d ops: %zu KB live in %d blocks, %ld KB resident (%.0f bytes per block above the start)\n",
+                   i + 1, live >> 10, live_blocks, kb, live_blocks ? (kb - start_kb) * 1024.0 / live_blocks : 0);
+        }
+    }
+    for (int id = 0; id < s->num_ids; id++) {
+        myfree(blocks[id].ptr);
+    }
+    if (stats && rss_interval) printf("  all freed: %ld KB resident\n", resident_kb());
+    return true;
+}
+
+//This function prints one line of per-operation numbers and sorts the samples.
+void print_op(const char *name, double *samples, int count) {
+    if (count == 0) return;
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += samples[i];
+    }
+    qsort(samples, count, sizeof(double), compare_doubles);
+    printf("  %-8s %8d %9.1f %8.0f %8.0f %8.0f %9.0f\n", name, count, sum / count, samples[count / 2],
+           samples[(int)(count * 0.99)], samples[(int)(count * 0.999)], samples[count - 1]);
+}
+
+//This function prints what mystats counted during a pass.
+void print_heap_stats(void) {
+    heap_stats st;
+    if (!mystats(&st)) {
+        printf("  stats: not counted (build with make STATS=1)\n");
+        return;
+    }
+    printf("  stats: %lu searches (%.2f blocks looked at each), %lu splits, %lu coalesces\n",
+           st.searches, st.searches ? (double)st.search_steps / st.searches : 0, st.splits,
+           st.coalesces);
+    printf("         realloc %lu in place, %lu moved, %zu bytes copied; %lu failed; peak %zu bytes in use, "
+           "footprint %zu, %zu blocks now\n", st.realloc_in_place, st.realloc_moved, st.realloc_copied,
+           st.failed, st.peak_bytes_in_use, st.peak_footprint, st.num_blocks);
+    if (st.purges != 0) printf("         %lu purges gave back %zu bytes\n", st.purges, st.purged_bytes);
+    printf("  sizes:");
+    for (int i = 0; i < STATS_SIZE_CLASSES; i++) {
+        if (st.size_hist[i] != 0) printf(" <=%lu:%lu", 8UL << i, st.size_hist[i]);
+    }
+    printf("\n");
+}
+
+/* This function benchmarks one script and adds its operations and
+ * best time to the totals. Returns false if the allocator failed to
+ * replay it.
+ */
+bool bench_script(const char *path, int repeats, long *total_ops, double *total_ns) {
+    script s;
+    if (!read_script(path, &s)) return false;
+    block *blocks = malloc((s.num_ids + 1) * sizeof(block));
+
+    //the first pass touches the pages the later ones reuse
+    bool ok = reset_heap() && replay(&s, blocks, NULL);
+    double best = 0;
+    for (int rep = 0; ok && rep < repeats; rep++) {
+        ok = reset_heap();
+        double begin = now_ns();
+        ok = ok && replay(&s, blocks, NULL);
+        double elapsed = now_ns() - begin;
+        if (rep == 0 || elapsed < best) best = elapsed;
+    }
+
+    double misses = -1; //per operation, or -1 if not counted
+    if (ok && count_misses) {
+        int fd = open_miss_counter();
+        long long count;
+        ok = reset_heap();
+        if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        ok = ok && replay(&s, blocks, NULL);
+        if (fd >= 0 && read(fd, &count, sizeof(count)) == sizeof(count)) misses = (double)count / s.num_ops;
+        if (fd >= 0) close(fd);
+    }
+
+    pass_stats stats = {0};
+    for (int type = 0; type < NUM_OP_TYPES; type++) {
+        stats.samples[type] = malloc((s.num_ops + 1) * sizeof(double));
+    }
+    stats.high_water = (uintptr_t)segment;
+    if (rss_interval) madvise(segment, SEGMENT_SIZE, MADV_DONTNEED); //start from nothing resident
+    if (ok) ok = reset_heap() && replay(&s, blocks, &stats);
+
+    if (ok) {
+        *total_ops += s.num_ops;
+        *total_ns += best;
+        printf("%s: %d ops, %.2f Mops/s, ", path, s.num_ops, s.num_ops / best * 1e3);
+        if (stats.outside) {
+            printf("utilization n/a\n");
+        } else {
+            printf("utilization %.1f%%\n",
+                   100.0 * stats.peak_payload / (stats.high_water - (uintptr_t)segment));
+        }
+        printf("  %-8s %8s %9s %8s %8s %8s %9s\n", "op (ns)", "count", "mean", "p50", "p99", "p99.9", "max");
+        for (int type = 0; type < NUM_OP_TYPES; type++) {
+            print_op(op_names[type], stats.samples[type], stats.counts[type]);
+        }
+        if (count_misses && misses < 0) {
+            printf("  cache misses: n/a (no hardware counter)\n");
+        } else if (count_misses) printf("  cache misses: %.2f per op\n", misses);
+        if (show_stats) print_heap_stats();
+    }
+    for (int type = 0; type < NUM_OP_TYPES; type++) {
+        free(stats.samples[type]);
+    }
+    free(blocks);
+    free_script(&s);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    int repeats = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "scm:r:")) != -1) {
+        if (opt == 's') show_stats = true;
+        else if (opt == 'c') count_misses = true;
+        else if (opt == 'm') rss_interval = atoi(optarg);
+        else if (opt == 'r') repeats = atoi(optarg);
+        else break;
+    }
+    if (optind >= argc || repeats < 1) {
+        printf("usage: %s [-s] [-c] [-m ops] [-r repeats] script...\n", argv[0]);
+        return 1;
+    }
+    segment = mmap(NULL, SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (segment == MAP_FAILED) {
+        printf("Could not map the heap segment.\n");
+        return 1;
+    }
+    clock_cost = measure_clock_cost();
+
+    int status = 0;
+    long total_ops = 0;
+    double total_ns = 0;
+    for (int i = optind; i < argc; i++) {
+        if (!bench_script(argv[i], repeats, &total_ops, &total_ns)) status = 1;
+    }
+    if (total_ops > 0) printf("total: %ld ops, %.2f Mops/s\n", total_ops, total_ops / total_ns * 1e3);
+    munmap(segment, SEGMENT_SIZE);
+    return status;
+}
@@ -0,0 +1,177 @@
+/*
+ * File: convert_trace.c
+ * Converts a text script, or a call log recorded by the preload library,
+ * into the binary trace format of script.h, which bench and mtbench map
+ * straight from the file instead of parsing it line by line. If the
+ * output name ends in .script, it writes the text format instead.
+ *
+ * usage: convert_trace in.script|in.log out.trace|out.script
+ */
+#include "script.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct { //open addressing from block address to the id it has in the script
+    uint64_t *addrs; //0 marks an empty slot
+    int *ids;
+    size_t capacity; //a power of two
+    size_t count;
+} id_map;
+
+static int compare_seq(const void *a, const void *b) {
+    uint64_t x = ((const call_record *)a)->seq, y = ((const call_record *)b)->seq;
+    return (x > y) - (x < y);
+}
+
+size_t slot_of(id_map *m, uint64_t addr) {
+    size_t i = (addr >> 4) * 0x9E3779B97F4A7C15ULL & (m->capacity - 1);
+    while (m->addrs[i] != 0 && m->addrs[i] != addr) {
+        i = (i + 1) & (m->capacity - 1);
+    }
+    return i;
+}
+
+//This function returns the id of the live block at addr, or -1.
+int find_id(id_map *m, uint64_t addr) {
+    size_t i = slot_of(m, addr);
+    return m->addrs[i] == addr ? m->ids[i] : -1;
+}
+
+void add_id(id_map *m, uint64_t addr, int id) {
+    if (2 * (m->count + 1) > m->capacity) {
+        id_map bigger = {calloc(2 * m->capacity, sizeof(uint64_t)),
+                         malloc(2 * m->capacity * sizeof(int)), 2 * m->capacity, 0};
+        for (size_t i = 0; i < m->capacity; i++) {
+            if (m->addrs[i] != 0) add_id(&bigger, m->addrs[i], m->ids[i]);
+        }
+        free(m->addrs);
+        free(m->ids);
+        *m = bigger;
+    }
+    size_t i = slot_of(m, addr);
+    m->addrs[i] = addr;
+    m->ids[i] = id;
+    m->count++;
+}
+
+//This function deletes addr, moving later entries of its run back into the gap.
+void remove_id(id_map *m, uint64_t addr) {
+    size_t i = slot_of(m, addr);
+    if (m->addrs[i] != addr) return;
+    m->addrs[i] = 0;
+    m->count--;
+    for (size_t j = (i + 1) & (m->capacity - 1); m->addrs[j] != 0; j = (j + 1) & (m->capacity - 1)) {
+        uint64_t moved = m->addrs[j];
+        int id = m->ids[j];
+        m->addrs[j] = 0;
+        m->count--;
+        add_id(m, moved, id);
+    }
+}
+
+/* This function reads a call log and turns it into script operations.
+ * Ids are reused once their block is freed, as in the sample scripts,
+ * so the replay table stays as small as the most blocks ever live.
+ * Frees of blocks the log never saw allocated are dropped.
+ */
+bool read_call_log(const char *path, script *s) {
+    memset(s, 0, sizeof(*s));
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        printf("Could not open log %s.\n", path);
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long bytes = ftell(fp) - (long)strlen(CALL_LOG_MAGIC);
+    fseek(fp, strlen(CALL_LOG_MAGIC), SEEK_SET);
+    size_t num_records = bytes > 0 ? bytes / sizeof(call_record) : 0;
+    call_record *records = malloc((num_records + 1) * sizeof(call_record));
+    num_records = fread(records, sizeof(call_record), num_records, fp);
+    fclose(fp);
+    //each thread wrote its own records in order, so they only need merging
+    qsort(records, num_records, sizeof(call_record), compare_seq);
+
+    s->ops = malloc((2 * num_records + 1) * sizeof(script_op));
+    int *free_ids = malloc((num_records + 1) * sizeof(int));
+    int num_free_ids = 0;
+    id_map live = {calloc(1024, sizeof(uint64_t)), malloc(1024 * sizeof(int)), 1024, 0};
+    for (size_t i = 0; i < num_records; i++) {
+        call_record *rec = &records[i];
+        int type = rec->type;
+        int id = type == OP_MALLOC ? -1 : find_id(&live, rec->old_ptr ? rec->old_ptr : rec->ptr);
+        if (type == OP_FREE) {
+            if (id < 0) continue;
+            remove_id(&live, rec->ptr);
+            free_ids[num_free_ids++] = id;
+            s->ops[s->num_ops++] = (script_op){((uint32_t)OP_FREE << OP_SHIFT) | id, 0};
+            s->counts[OP_FREE]++;
+            continue;
+        }
+        if (id < 0) {
+            type = OP_MALLOC;
+        } else remove_id(&live, rec->old_ptr);
+        //a block whose free has not been seen yet lost a race in the log; free it now
+        int stale = find_id(&live, rec->ptr);
+        if (stale >= 0) {
+            remove_id(&live, rec->ptr);
+            free_ids[num_free_ids++] = stale;
+            s->ops[s->num_ops++] = (script_op){((uint32_t)OP_FREE << OP_SHIFT) | stale, 0};
+            s->counts[OP_FREE]++;
+        }
+        if (id < 0) id = num_free_ids > 0 ? free_ids[--num_free_ids] : s->num_ids++;
+        add_id(&live, rec->ptr, id);
+        s->ops[s->num_ops++] = (script_op){((uint32_t)type << OP_SHIFT) | id, rec->size};
+        s->counts[type]++;
+    }
+    free(live.addrs);
+    free(live.ids);
+    free(free_ids);
+    free(records);
+    return true;
+}
+
+//This function writes s in the text format of the samples.
+bool write_script(const char *path, const script *s) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        printf("Could not create script %s.\n", path);
+        return false;
+    }
+    for (int i = 0; i < s->num_ops; i++) {
+        const script_op *op = &s->ops[i];
+        if (OP_TYPE(op) == OP_FREE) {
+            fprintf(fp, "f %u\n", OP_ID(op));
+        } else fprintf(fp, "%c %u %u\n", OP_TYPE(op) == OP_MALLOC ? 'a' : 'r', OP_ID(op), op->size);
+    }
+    bool ok = fclose(fp) == 0;
+    if (!ok) printf("Could not write script %s.\n", path);
+    return ok;
+}
+
+//This function tells whether path starts with the call log magic.
+bool is_call_log(const char *path) {
+    char magic[sizeof(CALL_LOG_MAGIC) - 1];
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return false;
+    bool log = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+               memcmp(magic, CALL_LOG_MAGIC, sizeof(magic)) == 0;
+    fclose(fp);
+    return log;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        printf("usage: %s in.script|in.log out.trace|out.script\n", argv[0]);
+        return 1;
+    }
+    script s;
+    bool ok = is_call_log(argv[1]) ? read_call_log(argv[1], &s) : read_script(argv[1], &s);
+    if (!ok) return 1;
+    size_t len = strlen(argv[2]);
+    if (len >= 7 && strcmp(argv[2] + len - 7, ".script") == 0) {
+        ok = write_script(argv[2], &s);
+    } else ok = write_trace(argv[2], &s);
+    free_script(&s);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,151 @@
+/*
+ * File: counterbench.c
+ * Shows what mymemalign is for: per-thread counters that do not share
+ * cache lines. Each of the threads increments a counter of its own, and
+ * the counters are allocated two ways: one mymalloc(sizeof(long)) after
+ * another, which packs several into a cache line so every increment
+ * takes the line from the threads next to it (false sharing), and with
+ * mymemalign(CACHE_LINE, CACHE_LINE), which gives each its own line.
+ * For each it prints how many cache lines the counters ended up on and
+ * the nanoseconds per increment, the best of several passes. On a
+ * machine with fewer cores than threads the threads take turns and the
+ * two come out alike.
+ *
+ * usage: counterbench_<allocator> [-t threads] [-n increments] [-r repeats]
+ */
+#include "allocator.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SEGMENT_SIZE ((size_t)1 << 30) //address space only, pages are touched on use
+#define CACHE_LINE 64
+#define MAX_THREADS 256
+
+typedef struct {
+    volatile long *counter;
+    long increments;
+    pthread_barrier_t *start;
+} worker;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void *run_worker(void *arg) {
+    worker *w = arg;
+    pthread_barrier_wait(w->start);
+    for (long i = 0; i < w->increments; i++) {
+        (*w->counter)++;
+    }
+    return NULL;
+}
+
+/* This function runs one pass: every thread increments its counter
+ * increments times. Returns the ns per increment of one thread, or a
+ * negative number if a counter is off.
+ */
+double run_pass(long **counters, int nthreads, long increments) {
+    pthread_t threads[MAX_THREADS];
+    worker workers[MAX_THREADS];
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (int i = 0; i < nthreads; i++) {
+        *counters[i] = 0;
+        workers[i] = (worker){counters[i], increments, &start};
+        if (pthread_create(&threads[i], NULL, run_worker, &workers[i]) != 0) {
+            printf("Could not start thread %d.\n", i);
+            exit(1); //the ones started wait at the barrier for good
+        }
+    }
+    pthread_barrier_wait(&start);
+    double begin = now_ns();
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_ns() - begin;
+    pthread_barrier_destroy(&start);
+    for (int i = 0; i < nthreads; i++) {
+        if (*counters[i] != increments) return -1;
+    }
+    return elapsed / increments;
+}
+
+//This function counts the distinct cache lines the counters lie in.
+int count_lines(long **counters, int nthreads) {
+    int lines = 0;
+    for (int i = 0; i < nthreads; i++) {
+        uintptr_t line = (uintptr_t)counters[i] / CACHE_LINE;
+        int j = 0;
+        while (j < i && (uintptr_t)counters[j] / CACHE_LINE != line) {
+            j++;
+        }
+        if (j == i) lines++;
+    }
+    return lines;
+}
+
+/* This function allocates the counters, packed or each on a cache line
+ * of its own, benchmarks them and frees them. Returns false if an
+ * allocation or a pass failed.
+ */
+bool bench_layout(bool aligned, int nthreads, long increments, int repeats) {
+    long *counters[MAX_THREADS];
+    for (int i = 0; i < nthreads; i++) {
+        counters[i] = aligned ? mymemalign(CACHE_LINE, CACHE_LINE) : mymalloc(sizeof(long));
+        if (counters[i] == NULL || (aligned && (uintptr_t)counters[i] % CACHE_LINE != 0)) {
+            printf("Counter %d was not allocated as asked.\n", i);
+            return false;
+        }
+    }
+    double best = 0;
+    for (int rep = 0; rep < repeats; rep++) {
+        double ns = run_pass(counters, nthreads, increments);
+        if (ns < 0) {
+            printf("A pass with %s counters failed.\n", aligned ? "aligned" : "packed");
+            return false;
+        }
+        if (rep == 0 || ns < best) best = ns;
+    }
+    printf("  %-8s %d counters on %d cache lines, %.2f ns per increment\n", aligned ? "aligned" : "packed",
+           nthreads, count_lines(counters, nthreads), best);
+    for (int i = 0; i < nthreads; i++) {
+        myfree(counters[i]);
+    }
+    return validate_heap();
+}
+
+int main(int argc, char *argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cpus > 2 ? (cpus < MAX_THREADS ? cpus : MAX_THREADS) : 2;
+    long increments = 50000000;
+    int repeats = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:r:")) != -1) {
+        if (opt == 't') nthreads = atoi(optarg);
+        else if (opt == 'n') increments = atol(optarg);
+        else if (opt == 'r') repeats = atoi(optarg);
+        else break;
+    }
+    if (optind < argc || nthreads < 1 || nthreads > MAX_THREADS || increments < 1 || repeats < 1) {
+        printf("usage: %s [-t threads] [-n increments] [-r repeats]\n", argv[0]);
+        return 1;
+    }
+    void *segment = mmap(NULL, SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (segment == MAP_FAILED || !myinit(segment, SEGMENT_SIZE)) {
+        printf("Could not set up the heap.\n");
+        return 1;
+    }
+    printf("%d threads on %ld cpus, %ld increments each\n", nthreads, cpus, increments);
+    int status = bench_layout(false, nthreads, increments, repeats) &&
+                 bench_layout(true, nthreads, increments, repeats) ? 0 : 1;
+    munmap(segment, SEGMENT_SIZE);
+    return status;
+}
@@ -2,255 +2,2425 @@
  * Name: Julie Wang
  * File: explicit.c
  * This program implements a explicit heap manager using
- * in-place reallocation and coalescing. The doubly linked list
- * is made with a last-in-first-out approach.
+ * in-place reallocation and coalescing. Free blocks are kept in
+ * segregated size-class lists: exact classes for small sizes and
+ * power-of-two ranges above that, with a bitmap of the non-empty
+ * classes. Each list is doubly linked with a last-in-first-out approach.
+ * Free blocks also end in a footer and every header remembers whether
+ * the block before it is free (and minimum-sized, in which case there
+ * is no room for a footer), so freeing merges both ways in O(1).
+ * Requests of up to SLAB_MAX_SIZE bytes are served from slabs: blocks
+ * of one SLAB_SIZE granule holding same-sized objects with no header
+ * of their own, tracked by a bitmap of free slots.
+ * The heap is shared between threads under one lock, and each thread
+ * keeps a small cache of freed slab objects per size that it refills
+ * from and flushes to the heap in batches, so most malloc/free pairs
+ * of slab-sized objects never touch the lock; larger mallocs take it.
+ * Frees of blocks from another thread's arena, or from a thread's own
+ * arena while another thread holds its lock, are pushed onto that
+ * arena's lock-free list and carried out by the next thread that takes
+ * its lock, so they never wait for it.
+ * myinit_arenas splits the segment into several such heaps (arenas),
+ * each with its own lock; threads are spread over them round-robin
+ * and a block is freed back to the arena its address lies in.
+ * myprofile turns on a sampling heap profiler: about once every so many
+ * bytes, mymalloc records the call stack and hands out an ordinary
+ * block marked in its header, whose last word points to the sample, so
+ * freeing it drops the sample without a lookup.
+ * Free blocks larger than TREE_MIN_SIZE are kept in a red-black tree
+ * ordered by size and then address instead, with the tree's nodes in
+ * their payloads, so the best fit among them (the lowest one of that
+ * size) is found in O(log n) and the big block at the end of the heap is
+ * only split once nothing smaller fits.
+ * The range classes are searched first fit unless built with -DNEXT_FIT
+ * (each class keeps a rover and a search starts there), -DBEST_FIT (the
+ * smallest block in the class) or -DGOOD_FIT=K (the smallest of the
+ * first K that fit).
+ * Requests of MMAP_THRESHOLD bytes or more get a mapping of their own
+ * outside the segment, marked in the header, so they never split the
+ * heap; myfree unmaps them and myrealloc resizes them with mremap, which
+ * moves the pages instead of copying them.
+ * When an arena runs out of room it grows by a chunk: a CHUNK_SIZE
+ * mapping, aligned to its size, holding one more run of blocks that
+ * ends in a fence header marked allocated, so nothing merges past it.
+ * A table of chunk addresses tells which arena and slab map a block
+ * outside the segment belongs to.
+ * Free tree blocks remember when they were last written to and which
+ * of their whole pages are known to be zero. They also go on a list in
+ * the order they went into the tree. Every PURGE_INTERVAL heap
+ * operations, the oldest blocks on it that were left alone for
+ * PURGE_DECAY operations have their pages given back with madvise and
+ * leave the list, so memory reused soon is not purged only to be
+ * faulted back in, and a purge never walks the whole tree.
+ * Built with -DCOMPACT_LINKS, the freelists link blocks by 32-bit
+ * offsets from the start of the heap instead of pointers, which brings
+ * the smallest block down from 24 bytes to 16. That needs a segment of
+ * at most 4 GB and no chunks, so such a heap cannot grow.
  */
+#define _GNU_SOURCE //mremap
 #include "allocator.h"
 #include "debug_break.h"
+#include "stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #define HEADER_SIZE 8 //bytes
+#define FOOTER_SIZE 8 //free blocks only
+#define USED_BIT 0x1
+#define PREV_FREE 0x2 //block right before this one is free
+#define PREV_MIN 0x4 //block right before this one is a free block of MIN_PAYLOAD bytes
+#define SAMPLED_BIT (1UL << 63) //block is sampled by the profiler; its last word points to the sample
+#define MAPPED_BIT (1UL << 62) //block has a mapping of its own, outside the segment
+#define FLAG_BITS (0x7 | SAMPLED_BIT | MAPPED_BIT)
 
-typedef struct { //this stores prev and next pointers for freelist
-    void *prev;
-    void *nxt;
+#define NUM_BINS 64 //one bit per bin in bin_map
+#define MAX_EXACT_SIZE 256 //largest payload with its own exact class
+#define TREE_MIN_SIZE 1024 //free blocks larger than this go in the tree; a power of two
+
+#ifdef COMPACT_LINKS
+/* Freelist links as offsets from heap_base, 0 for none, so that a free
+ * block only needs 8 bytes of payload. The heap must not grow past a
+ * segment of COMPACT_LIMIT bytes, so there are no chunks.
+ */
+typedef struct listnode {
+    uint32_t prev;
+    uint32_t nxt;
 } listnode;
+#define COMPACT_LIMIT ((size_t)1 << 32) //largest segment whose offsets fit in the links
+#else
+typedef struct listnode { //this stores prev and next pointers for freelist
+    struct listnode *prev;
+    struct listnode *nxt;
+} listnode;
+#endif
 
 typedef struct {
     unsigned long size; //takes care of casting header size
 } header; 
 
+typedef struct { //a page-aligned range of a free block known to read as zero
+    char *from;
+    char *to;
+} extent;
+
+typedef struct { //what is known of a free block's pages
+    unsigned long dirty_at; //arena ops when most of the block last took in memory that may be dirty
+    extent clean; //pages purged since, or never touched
+} page_state;
+
+typedef struct treenode { //free blocks above TREE_MIN_SIZE, ordered by size and then address
+    struct treenode *left;
+    struct treenode *right;
+    struct treenode *parent;
+    struct treenode *older; //neighbors on the arena's decay list
+    struct treenode *newer;
+    bool red;
+    bool queued; //on the decay list: not purged since it went into the tree
+    page_state pages;
+} treenode;
+
+#define MIN_PAYLOAD sizeof(listnode) //free blocks this small have no footer
+#define MIN_BLOCK (HEADER_SIZE + MIN_PAYLOAD) //smallest block we can split off
+#define NUM_EXACT_BINS (((MAX_EXACT_SIZE - MIN_PAYLOAD) >> 3) + 1) //MIN_PAYLOAD, +8, ..., 256
+#define TREE_BIN (NUM_EXACT_BINS + __builtin_ctzl(TREE_MIN_SIZE) - 8) //the class after the last range class; its bin_map bit is set iff the tree is non-empty
+
+#define SLAB_SHIFT 11
+#define SLAB_SIZE (1UL << SLAB_SHIFT) //a slab is exactly one aligned granule
+#define SLAB_MAX_SIZE 64 //largest request served from a slab
+#define NUM_SLAB_CLASSES 8
+#define SLAB_MAP_WORDS 4 //enough bits for the 8-byte class
+#define SLAB_MIN_LIVE 64 //small blocks that must be live before slabs are used
+
+/* A slab lives in the payload of an ordinary allocated block whose
+ * header sits at the start of a SLAB_SIZE-aligned granule, so the
+ * block ends exactly where the next granule starts. The objects
+ * follow this struct up to the end of the granule.
+ */
+typedef struct slab {
+    struct slab *prev; //partial slabs of the same class
+    struct slab *nxt;
+    unsigned int obj_size;
+    unsigned int nfree;
+    unsigned long free_map[SLAB_MAP_WORDS]; //bit set = slot is free
+} slab;
+
+#define SLAB_OBJ_START (HEADER_SIZE + sizeof(slab)) //offset of the first object in the granule
+
+#define TCACHE_MAX_SIZE SLAB_MAX_SIZE //largest block kept in a thread cache
+#define TCACHE_CLASSES ((TCACHE_MAX_SIZE >> 3) + 1) //one per 8 bytes of usable size
+#define TCACHE_LIMIT 16 //blocks per class before half of them go back
+#define TCACHE_BATCH 8 //most blocks taken from the heap on a miss
+
+#define MAX_ARENAS 64
+#define MMAP_THRESHOLD (1 << 20) //smallest request that gets a mapping of its own
+#define CHUNK_SHIFT 26
+#define CHUNK_SIZE (1UL << CHUNK_SHIFT) //an arena grows by one aligned chunk at a time
+#define CHUNK_GRANULES (CHUNK_SIZE >> SLAB_SHIFT)
+#define CHUNK_TABLE 4096 //slots in chunk_table, kept at most half full
+#define PURGE_INTERVAL 1024 //heap operations between looks for blocks to purge
+#define PURGE_DECAY 8192 //heap operations a free block must go untouched before it is purged
+#define SORT_CUTOFF 64 //most pointers myfree_batch sorts with insertion sort
+#define STATS_FOLD 64 //calls a thread counts on its own before adding them to the totals
+#define PROFILE_FRAMES 32 //deepest call stack kept for a sample
+#define PROFILE_IDLE_CHECK (1L << 20) //bytes between checks for the profiler being turned on
+#define SAMPLE_BATCH (64 * 1024) //bytes of sample records mapped at a time
+
+#if defined(BEST_FIT)
+#define FIT_CANDIDATES INT_MAX
+#elif defined(GOOD_FIT)
+#define FIT_CANDIDATES GOOD_FIT //blocks that fit to compare before taking the smallest
+#else
+#define FIT_CANDIDATES 1 //first fit, or next fit from the rover
+#endif
+
+/* An arena is an independent heap over one slice of the segment, with
+ * its own lock, freelists, slabs and remote-free list. Arenas are kept
+ * a cache line apart so threads working in different ones do not share
+ * any lines. A block always goes back to the arena it came from.
+ */
+typedef struct arena {
+    pthread_mutex_t lock; //guards everything below except remote_frees
+    void *start;
+    void *end;
+    size_t size;
+    listnode *bins[NUM_BINS]; //heads of the size-class freelists
+    unsigned long bin_map; //bit i is set iff bins[i] is non-empty
+    treenode *tree_root; //free blocks of TREE_BIN
+    treenode *decay_oldest; //tree blocks not purged yet, in the order they went into the tree
+    treenode *decay_newest;
+#ifdef NEXT_FIT
+    listnode *rovers[NUM_BINS]; //where the next search of each class starts, NULL for its head
+#endif
+    size_t nbytes_inuse; //bytes currently in use
+    int num_header;
+    size_t nused;
+    slab *partial[NUM_SLAB_CLASSES]; //slabs with at least one free slot
+    int small_live; //small requests currently served by ordinary blocks
+    void *remote_frees; //blocks freed without the lock, newest first, linked through their first word
+    struct chunk *chunks; //chunks the arena grew by, newest first
+    int num_chunks;
+    unsigned long ops; //heap mallocs and frees, the clock purging decays by
+    unsigned long next_purge; //ops at which to look for blocks to purge
+    extent handed_zero; //pages of the block alloc_block last handed out known to read as zero
+    heap_stats stats; //counters kept under the lock (HEAP_STATS only)
+} __attribute__((aligned(64))) arena;
+
+/* A chunk starts with this struct; its blocks follow and run up to a
+ * fence header at the very end. The slab map covers the chunk's own
+ * granules.
+ */
+typedef struct chunk {
+    arena *owner;
+    struct chunk *nxt; //next chunk of the same arena
+    unsigned char slab_map[CHUNK_GRANULES / 8];
+} chunk;
+
+/* Freed objects in a thread cache stay allocated as far as the heap
+ * is concerned and are linked through their first word. Only slab
+ * objects are cached: they never coalesce anyway, while a cached
+ * ordinary block would keep its free neighbors from merging.
+ */
+typedef struct {
+    void *heads[TCACHE_CLASSES];
+    unsigned int count[TCACHE_CLASSES];
+    unsigned int batch[TCACHE_CLASSES]; //blocks to take on the next miss
+    unsigned long epoch; //heap_epoch the cached blocks belong to
+    arena *home; //arena this thread allocates from; all cached blocks come from it
+    heap_stats counted; //calls counted without a lock, not yet in thread_totals (HEAP_STATS only)
+    int uncounted; //calls since counted was last added in
+    long until_sample; //bytes this thread allocates before its next sample
+    unsigned long rng; //state of the generator picking sample intervals
+    bool in_profiler; //set while taking a sample, which may itself call mymalloc
+} tcache;
+
+/* A mapped block has this record, then an ordinary header with
+ * MAPPED_BIT set, in the first page of its mapping, and its payload
+ * runs to the end of the last page. The record starts the mapping
+ * unless the payload had to be aligned further in. Live mappings are
+ * linked so that myinit can unmap them.
+ */
+typedef struct mapping {
+    struct mapping *prev;
+    struct mapping *nxt;
+    size_t length; //bytes mapped, counting this record
+} mapping;
+
+/* A region is one ordinary block whose payload starts with this
+ * struct. Its objects are cut from the rest of the payload by bumping
+ * next, have no headers, and are only ever freed all at once.
+ */
+struct region {
+    char *next; //where the next object starts
+    char *end; //end of the space objects may take
+};
+
+/* A live sample: one sampled block and the call stack that allocated
+ * it. Records come from mmap'd batches, never from the heap itself.
+ */
+typedef struct sample {
+    void *frames[PROFILE_FRAMES];
+    int depth;
+    size_t size; //bytes requested
+    void *block; //payload of the sampled block
+    struct sample *prev;
+    struct sample *nxt;
+} sample;
+
+static const unsigned int slab_sizes[NUM_SLAB_CLASSES] = {
+    8, 16, 24, 32, 40, 48, 56, 64
+};
+
+static arena arenas[MAX_ARENAS];
+static int num_arenas;
+static void *heap_base; //start of the first arena
+static void *heap_end; //end of the last arena; blocks outside are mapped
+static size_t arena_span; //distance between arena starts, a multiple of SLAB_SIZE
+static unsigned int next_arena; //round-robin counter for threads picking a home
+//static int countline; //for debugging purposes
+
+static unsigned char *slab_map; //one bit per granule of the whole segment, set if it holds a slab
+static uintptr_t first_granule;
+static uintptr_t num_granules; //granules the segment's slab map covers
+static unsigned char slab_class[(SLAB_MAX_SIZE >> 3) + 1]; //size / 8 -> class
+
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER; //serializes myinit
+
+static size_t page_size; //the unit madvise works in
+static char *segment_zero; //where the pages of the segment no heap has written to start
+static bool segment_anonymous; //given to myinit_anonymous, so pages given back read as zero
+
+static chunk *chunk_table[CHUNK_TABLE]; //open addressing by address; read without a lock
+static int num_chunks;
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER; //guards adding to the table
+static unsigned long heap_epoch; //bumped by myinit so caches from before are dropped
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key; //only used to flush a cache when its thread exits
+static __thread tcache cache;
+static heap_stats thread_totals; //what threads counted on their own
+static size_t heap_in_use; //payload bytes in use over every arena, kept with HEAP_STATS
+static size_t heap_peak_in_use; //the most heap_in_use has been since myinit
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; //guards thread_totals
+
+static size_t profile_rate; //mean bytes allocated between samples, 0 when not profiling
+static sample *live_samples; //samples whose block is still allocated
+static sample *spare_samples; //records to reuse, linked through nxt
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER; //guards the samples; taken after an arena lock
+
+static mapping *mappings; //blocks with a mapping of their own
+static size_t mapped_bytes; //their payload bytes
+static int num_mappings;
+static pthread_mutex_t mapping_lock = PTHREAD_MUTEX_INITIALIZER; //guards the three above; taken after an arena lock
+
+void add_to_beg(arena *ar, header *hdr);
+void tree_insert(arena *ar, header *hdr);
+void tree_remove(arena *ar, treenode *node);
+void decay_push(arena *ar, treenode *node);
+void decay_unlink(arena *ar, treenode *node);
+void note_state(header *hdr, page_state state);
+void free_block(arena *ar, header *hdr);
+void drain_remote(arena *ar);
+void arena_init(arena *ar, void *start, size_t size, char *zero_from);
+bool setup_heap(void *heap_start, size_t heap_size, int narenas, bool anonymous);
+char *mapping_base(mapping *m);
+bool check_heap(arena *ar);
+bool check_fence(header *fence, bool prev_free, bool prev_min);
+bool check_mappings(void);
+void dump_arena(arena *ar);
+void fold_thread_stats(tcache *tc);
+void forget_sample(header *hdr);
+
+/*
+ * This function rounds up the size requested to the given multiple 
+ * (must b * e a power of 2) and returns the result (taken from bump.c).
+ */
+size_t addpad(size_t size, size_t mult) {
+    return (size + mult - 1) & ~(mult - 1);
+}
+
+//This function tells whether ptr lies in the segment passed to myinit.
+bool in_segment(void *ptr) {
+    return (char *)ptr >= (char *)heap_base && (char *)ptr < (char *)heap_end;
+}
+
+//This function finds the chunk ptr lies in, or returns NULL if it is in none.
+chunk *chunk_of(void *ptr) {
+    uintptr_t base = (uintptr_t)ptr & ~(CHUNK_SIZE - 1);
+    for (size_t i = (base >> CHUNK_SHIFT) % CHUNK_TABLE;; i = (i + 1) % CHUNK_TABLE) {
+        chunk *ch = __atomic_load_n(&chunk_table[i], __ATOMIC_ACQUIRE);
+        if (ch == NULL || (uintptr_t)ch == base) return ch;
+    }
+}
+
+header *chunk_first(chunk *ch) {
+    return (header *)((char *)ch + sizeof(chunk));
+}
+
+header *chunk_fence(chunk *ch) {
+    return (header *)((char *)ch + CHUNK_SIZE - HEADER_SIZE);
+}
+
+//These functions read a header without its flag bits.
+size_t get_size(header *hdr) {
+    return hdr->size & ~(unsigned long)FLAG_BITS;
+}
+
+bool is_used(header *hdr) {
+    return hdr->size & USED_BIT;
+}
+
+//This function returns the header of the block right after hdr.
+header *next_header(header *hdr) {
+    return (header *)((char *)hdr + HEADER_SIZE + get_size(hdr));
+}
+
+//This function uses the footer of the free block before hdr to find its header.
+header *prev_header(header *hdr) {
+    if (hdr->size & PREV_MIN) return (header *)((char *)hdr - MIN_BLOCK);
+    unsigned long prev_size = *(unsigned long *)((char *)hdr - FOOTER_SIZE);
+    return (header *)((char *)hdr - prev_size - HEADER_SIZE);
+}
+
+header *node_to_header(listnode *node) {
+    return (header *)((char *)node - HEADER_SIZE);
+}
+
+listnode *header_to_node(header *hdr) {
+    return (listnode *)((char *)hdr + HEADER_SIZE);
+}
+
+//These functions follow and set the freelist links of a node.
+#ifdef COMPACT_LINKS
+listnode *node_prev(listnode *node) {
+    return node->prev != 0 ? (listnode *)((char *)heap_base + node->prev) : NULL;
+}
+
+listnode *node_next(listnode *node) {
+    return node->nxt != 0 ? (listnode *)((char *)heap_base + node->nxt) : NULL;
+}
+
+void set_prev(listnode *node, listnode *prev) {
+    node->prev = prev != NULL ? (char *)prev - (char *)heap_base : 0;
+}
+
+void set_next(listnode *node, listnode *nxt) {
+    node->nxt = nxt != NULL ? (char *)nxt - (char *)heap_base : 0;
+}
+#else
+listnode *node_prev(listnode *node) {
+    return node->prev;
+}
+
+listnode *node_next(listnode *node) {
+    return node->nxt;
+}
+
+void set_prev(listnode *node, listnode *prev) {
+    node->prev = prev;
+}
+
+void set_next(listnode *node, listnode *nxt) {
+    node->nxt = nxt;
+}
+#endif
+
+/* This function maps a free block size to its size class. Sizes up
+ * to MAX_EXACT_SIZE get one class per 8 bytes, so every block in such
+ * a class fits any request of that class. Larger sizes share a class
+ * per power-of-two range: (256, 512], (512, 1024], and everything
+ * above TREE_MIN_SIZE is TREE_BIN.
+ */
+int find_bin(size_t size) {
+    if (size <= MAX_EXACT_SIZE) return (size - MIN_PAYLOAD) >> 3;
+    if (size > TREE_MIN_SIZE) return TREE_BIN;
+    int bin = NUM_EXACT_BINS + (63 - __builtin_clzl(size - 1)) - 8;
+    return bin < NUM_BINS ? bin : NUM_BINS - 1;
+}
+
+/* This function writes the footer of a free block and tells the
+ * block after it that its left neighbor is now free. Minimum-sized
+ * blocks get no footer; the PREV_MIN bit stands in for their size.
+ */
+void mark_free(arena *ar, header *hdr) {
+    header *next = next_header(hdr);
+    if (get_size(hdr) > MIN_PAYLOAD) {
+        *(unsigned long *)((char *)next - FOOTER_SIZE) = get_size(hdr);
+    }
+    if ((void *)next == ar->end) return;
+    next->size &= ~(unsigned long)PREV_MIN;
+    next->size |= get_size(hdr) > MIN_PAYLOAD ? PREV_FREE : PREV_FREE | PREV_MIN;
+}
+
+//This function sets the allocated bit and updates the block after hdr.
+void mark_used(arena *ar, header *hdr) {
+    hdr->size |= USED_BIT;
+    header *next = next_header(hdr);
+    if ((void *)next != ar->end) next->size &= ~(unsigned long)(PREV_FREE | PREV_MIN);
+}
+
+/* This function moves the heap's reach to the end of the segment slice
+ * if the block hdr, just handed out or resized, runs up to it. When a
+ * split leaves a free tail there, split_block notes the reach instead.
+ */
+void note_reach(arena *ar, header *hdr) {
+    if ((void *)next_header(hdr) == ar->end) ar->nused = ar->size;
+}
+
+/* This function changes ar's payload bytes in use by delta. With
+ * HEAP_STATS it also keeps the total over every arena and its high,
+ * so the peak is of the whole heap at one moment rather than a sum of
+ * peaks the arenas reached at different times.
+ */
+void add_in_use(arena *ar, long delta) {
+    ar->nbytes_inuse += delta;
+    STAT(size_t total = __atomic_add_fetch(&heap_in_use, delta, __ATOMIC_RELAXED);
+         size_t peak = __atomic_load_n(&heap_peak_in_use, __ATOMIC_RELAXED);
+         while (total > peak && !__atomic_compare_exchange_n(&heap_peak_in_use, &peak, total, true,
+                                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {});
+}
+
+//This function keeps small_live current as an ordinary block is handed out, resized or freed.
+void count_small(arena *ar, header *hdr, int delta) {
+    if (get_size(hdr) <= SLAB_MAX_SIZE) ar->small_live += delta;
+}
+
+/* 
+ * Myint is called by a client before making any allocation
+ * requests from any thread.  The function returns true if initialization was 
+ * successful, or false otherwise. The myinit function can be 
+ * called to reset the heap to an empty state. When running 
+ * against a set of of test scripts, our test harness calls 
+ * myinit before starting each new script.
+ */
+bool myinit(void *heap_start, size_t heap_size) {
+    return setup_heap(heap_start, heap_size, 1, false);
+}
+
+//This function is myinit for the multi-arena mode.
+bool myinit_arenas(void *heap_start, size_t heap_size, int narenas) {
+    return setup_heap(heap_start, heap_size, narenas, false);
+}
+
+/* This function is myinit_arenas for a segment of private anonymous
+ * memory, which it gives back first; mycalloc and purging can then
+ * count on pages given back reading as zero.
+ */
+bool myinit_anonymous(void *heap_start, size_t heap_size, int narenas) {
+    return setup_heap(heap_start, heap_size, narenas, true);
+}
+
+void init_arena_locks(void) {
+    for (int i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+    }
+}
+
+/* This function returns where the pages of the segment that read as zero
+ * start, before the heap in it is reset. Nothing is known of a segment
+ * that is not private anonymous memory, so none of it does. Otherwise
+ * a segment not seen before is given back with MADV_DONTNEED first, so
+ * all of it does. In the same segment, the heaps since then wrote as
+ * far as their arena reached, or anywhere if one had several.
+ */
+char *segment_zero_from(void *heap_start, size_t usable, bool anonymous) {
+    char *end = (char *)heap_start + usable;
+    bool seen = segment_anonymous && heap_start == heap_base && end == heap_end;
+    segment_anonymous = anonymous;
+    if (!anonymous) {
+        segment_zero = end;
+        return segment_zero;
+    }
+    if (seen) {
+        char *reach = (char *)arenas[0].start + arenas[0].nused + HEADER_SIZE + sizeof(treenode);
+        if (num_arenas > 1) reach = end;
+        reach = (char *)addpad((uintptr_t)reach, page_size);
+        if (reach > segment_zero) segment_zero = reach;
+        return segment_zero;
+    }
+    char *from = (char *)addpad((uintptr_t)heap_start, page_size);
+    char *to = (char *)((uintptr_t)end & ~(page_size - 1));
+    segment_zero = from < to && madvise(from, to - from, MADV_DONTNEED) != 0 ? end : from;
+    return segment_zero;
+}
+
+/* This function resets the heap over the segment, split into narenas
+ * slices of equal size, each an arena with its own lock and freelists.
+ * Threads pick a home arena round-robin on their first request. With
+ * anonymous the segment is taken to be private anonymous memory, whose
+ * pages read as zero once given back. Returns false if narenas is out
+ * of range or the segment is too small to give every arena a granule.
+ */
+bool setup_heap(void *heap_start, size_t heap_size, int narenas, bool anonymous) {
+    static pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+    pthread_once(&locks_once, init_arena_locks);
+    if (narenas < 1 || narenas > MAX_ARENAS) return false;
+#ifdef COMPACT_LINKS
+    if (heap_size > COMPACT_LIMIT) return false;
+#endif
+
+    //the slab map takes one bit per granule at the very end of the segment
+    first_granule = (uintptr_t)heap_start >> SLAB_SHIFT;
+    num_granules = (((uintptr_t)heap_start + heap_size - 1) >> SLAB_SHIFT) - first_granule + 1;
+    size_t map_bytes = addpad((num_granules + 7) / 8, ALIGNMENT);
+
+    //check if heap_size is at least one block (header + two links) plus the map
+    if (heap_size < MIN_BLOCK + map_bytes) return false;
+    size_t usable = (heap_size - map_bytes) & ~(unsigned long)(ALIGNMENT - 1);
+    size_t span = narenas == 1 ? usable : (usable / narenas) & ~(unsigned long)(SLAB_SIZE - 1);
+    if (span < MIN_BLOCK || (narenas > 1 && span < SLAB_SIZE)) return false;
+
+    pthread_mutex_lock(&init_lock);
+    page_size = sysconf(_SC_PAGESIZE);
+    char *zero_from = segment_zero_from(heap_start, usable, anonymous);
+    pthread_mutex_lock(&chunk_lock);
+    for (int i = 0; i < CHUNK_TABLE; i++) { //chunks belong to the old heap
+        if (chunk_table[i] != NULL) munmap(chunk_table[i], CHUNK_SIZE);
+        chunk_table[i] = NULL;
+    }
+    num_chunks = 0;
+    pthread_mutex_unlock(&chunk_lock);
+    heap_base = heap_start;
+    heap_end = (char *)heap_start + usable;
+    arena_span = span;
+    num_arenas = narenas;
+    next_arena = 0;
+    slab_map = (unsigned char *)heap_start + usable;
+    memset(slab_map, 0, map_bytes);
+    for (int i = 0, c = 0; i <= (SLAB_MAX_SIZE >> 3); i++) {
+        if (slab_sizes[c] < (i << 3)) c++;
+        slab_class[i] = c;
+    }
+    for (int i = 0; i < narenas; i++) {
+        size_t size = i < narenas - 1 ? span : usable - span * i; //the last arena takes the rest
+        arena_init(&arenas[i], (char *)heap_start + span * i, size, zero_from);
+    }
+    pthread_mutex_lock(&stats_lock);
+    memset(&thread_totals, 0, sizeof(thread_totals));
+    heap_in_use = 0;
+    heap_peak_in_use = 0;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_mutex_lock(&mapping_lock);
+    while (mappings != NULL) { //mapped blocks belong to the old heap too
+        mapping *m = mappings;
+        mappings = m->nxt;
+        munmap(mapping_base(m), m->length);
+    }
+    mapped_bytes = 0;
+    num_mappings = 0;
+    pthread_mutex_unlock(&mapping_lock);
+    pthread_mutex_lock(&profile_lock);
+    while (live_samples != NULL) { //their blocks are gone
+        sample *smp = live_samples;
+        live_samples = smp->nxt;
+        smp->nxt = spare_samples;
+        spare_samples = smp;
+    }
+    pthread_mutex_unlock(&profile_lock);
+    __atomic_add_fetch(&heap_epoch, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&init_lock);
+    return true;
+}
+
+/* Arenas grow by chunks, so the segment only needs to be big enough to
+ * start with, except under COMPACT_LINKS, whose links only reach across
+ * the segment.
+ */
+bool mygrows(void) {
+#ifdef COMPACT_LINKS
+    return false;
+#else
+    return true;
+#endif
+}
+
+/* This function turns the slice of size bytes at start into an empty
+ * arena, whose pages from zero_from on read as zero.
+ */
+void arena_init(arena *ar, void *start, size_t size, char *zero_from) {
+    ar->size = size;
+    ar->start = start;
+    ar->end = (char *)ar->start + ar->size;
+    memset(ar->partial, 0, sizeof(ar->partial));
+    ar->small_live = 0;
+    ar->remote_frees = NULL;
+    ar->chunks = NULL;
+    ar->num_chunks = 0;
+    ar->ops = 0;
+    ar->next_purge = PURGE_INTERVAL;
+    memset(&ar->stats, 0, sizeof(ar->stats));
+
+    //initialize header
+    header *first = (header *)ar->start;
+    ar->nbytes_inuse = 0; //initiate payload bytes in-use to 0
+    first->size = ar->size - HEADER_SIZE; //lsb = 0
+    ar->num_header = 1;
+
+    ar->nused = MIN_BLOCK; //24 bytes, 16 with COMPACT_LINKS
+
+    //initialize the size classes with the first free header
+    memset(ar->bins, 0, sizeof(ar->bins));
+    ar->bin_map = 0;
+    ar->tree_root = NULL;
+    ar->decay_oldest = ar->decay_newest = NULL;
+#ifdef NEXT_FIT
+    memset(ar->rovers, 0, sizeof(ar->rovers));
+#endif
+    mark_free(ar, first);
+    add_to_beg(ar, first);
+    note_state(first, (page_state){ar->ops, {zero_from, ar->end}});
+
+    //countline = 0; --for debugging purposes
+}
+
+//This function finds the arena that ptr was allocated from by its address.
+arena *arena_of(void *ptr) {
+    if (num_arenas == 1) return &arenas[0];
+    if (!in_segment(ptr)) return chunk_of(ptr)->owner;
+    size_t idx = ((char *)ptr - (char *)heap_base) / arena_span;
+    return &arenas[idx < (size_t)num_arenas ? idx : (size_t)num_arenas - 1];
+}
+
+/* This function adds a chunk to arena ar, with its lock held: a fresh
+ * mapping aligned to CHUNK_SIZE that holds one free block and the fence
+ * after it. Returns false if a block of needed bytes would not fit in a
+ * chunk or no chunk can be had, as under COMPACT_LINKS.
+ */
+bool grow_arena(arena *ar, size_t needed) {
+#ifdef COMPACT_LINKS
+    return false; //a chunk's blocks could lie too far from heap_base for the links
+#endif
+    size_t block_bytes = CHUNK_SIZE - sizeof(chunk) - HEADER_SIZE; //block headers included, fence not
+    if (needed > block_bytes - HEADER_SIZE || __atomic_load_n(&num_chunks, __ATOMIC_RELAXED) >= CHUNK_TABLE / 2) {
+        return false;
+    }
+    //map twice the size and trim it to the aligned chunk inside
+    char *map = mmap(NULL, 2 * CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) return false;
+    char *base = (char *)addpad((uintptr_t)map, CHUNK_SIZE);
+    if (base != map) munmap(map, base - map);
+    munmap(base + CHUNK_SIZE, map + CHUNK_SIZE - base);
+
+    chunk *ch = (chunk *)base; //the mapping is zeroed, so no granule holds a slab yet
+    ch->owner = ar;
+    header *first = chunk_first(ch);
+    first->size = block_bytes - HEADER_SIZE;
+    chunk_fence(ch)->size = USED_BIT;
+    ar->num_header++;
+    mark_free(ar, first);
+    add_to_beg(ar, first);
+    note_state(first, (page_state){ar->ops, {base, base + CHUNK_SIZE}}); //a fresh mapping is all zero
+
+    pthread_mutex_lock(&chunk_lock);
+    num_chunks++;
+    size_t i = ((uintptr_t)ch >> CHUNK_SHIFT) % CHUNK_TABLE;
+    while (chunk_table[i] != NULL) {
+        i = (i + 1) % CHUNK_TABLE;
+    }
+    __atomic_store_n(&chunk_table[i], ch, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&chunk_lock);
+    ch->nxt = ar->chunks;
+    ar->chunks = ch;
+    ar->num_chunks++;
+    return true;
+}
+
+/* This function updates the freelist of hdr's size class by
+ * adding the new node to its beginning, or puts hdr in the tree.
+ */
+void add_to_beg(arena *ar, header *hdr) {
+    int bin = find_bin(get_size(hdr));
+    if (bin == TREE_BIN) {
+        tree_insert(ar, hdr);
+        ar->bin_map |= 1UL << TREE_BIN;
+        return;
+    }
+    listnode *newfree = header_to_node(hdr);
+    set_prev(newfree, NULL);
+    set_next(newfree, ar->bins[bin]);
+    if (ar->bins[bin] != NULL) set_prev(ar->bins[bin], newfree);
+    ar->bins[bin] = newfree;
+    ar->bin_map |= 1UL << bin;
+}
+
+/* This function helps to remove the passed in node from
+ * the freelist of its size class, or from the tree. The block
+ * size must not have changed since the node was added.
+ */
+void remove_node(arena *ar, listnode *ithnode) {
+    if (get_size(node_to_header(ithnode)) > TREE_MIN_SIZE) {
+        tree_remove(ar, (treenode *)ithnode);
+        if (ar->tree_root == NULL) ar->bin_map &= ~(1UL << TREE_BIN);
+        return;
+    }
+#ifdef NEXT_FIT
+    int rbin = find_bin(get_size(node_to_header(ithnode)));
+    if (ar->rovers[rbin] == ithnode) ar->rovers[rbin] = node_next(ithnode);
+#endif
+    listnode *prev = node_prev(ithnode), *nxt = node_next(ithnode);
+    if (prev == NULL) { //start
+        int bin = find_bin(get_size(node_to_header(ithnode)));
+        ar->bins[bin] = nxt;
+        if (ar->bins[bin] == NULL) ar->bin_map &= ~(1UL << bin);
+    } else set_next(prev, nxt);
+    if (nxt != NULL) set_prev(nxt, prev);
+}
+
+header *tree_header(treenode *node) {
+    return (header *)((char *)node - HEADER_SIZE);
+}
+
+bool is_red(treenode *node) {
+    return node != NULL && node->red;
+}
+
+//This function orders tree nodes by block size, and equal sizes by address.
+bool tree_less(treenode *a, treenode *b) {
+    size_t size_a = get_size(tree_header(a)), size_b = get_size(tree_header(b));
+    return size_a < size_b || (size_a == size_b && a < b);
+}
+
+//This function puts new in old's place under parent (or at the root).
+void replace_child(arena *ar, treenode *parent, treenode *old, treenode *new) {
+    if (parent == NULL) {
+        ar->tree_root = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else parent->right = new;
+}
+
+/* These functions rotate the subtree at node to the left or right: the
+ * child on the other side takes node's place and node becomes its child.
+ */
+void rotate_left(arena *ar, treenode *node) {
+    treenode *child = node->right;
+    node->right = child->left;
+    if (child->left != NULL) child->left->parent = node;
+    child->parent = node->parent;
+    replace_child(ar, node->parent, node, child);
+    child->left = node;
+    node->parent = child;
+}
+
+void rotate_right(arena *ar, treenode *node) {
+    treenode *child = node->left;
+    node->left = child->right;
+    if (child->right != NULL) child->right->parent = node;
+    child->parent = node->parent;
+    replace_child(ar, node->parent, node, child);
+    child->right = node;
+    node->parent = child;
+}
+
+/* This function adds the free block hdr to the tree and rebalances it:
+ * a red node under a red parent is fixed by recoloring while the uncle
+ * is red too, and otherwise by at most two rotations.
+ */
+void tree_insert(arena *ar, header *hdr) {
+    treenode *node = (treenode *)header_to_node(hdr);
+    treenode *parent = NULL;
+    treenode **link = &ar->tree_root;
+    while (*link != NULL) {
+        parent = *link;
+        link = tree_less(node, parent) ? &parent->left : &parent->right;
+    }
+    node->left = node->right = NULL;
+    node->parent = parent;
+    node->red = true;
+    node->pages = (page_state){ar->ops, {NULL, NULL}};
+    *link = node;
+    decay_push(ar, node);
+
+    while (is_red(parent = node->parent)) {
+        treenode *grand = parent->parent; //there is one, since the root is black
+        treenode *uncle = parent == grand->left ? grand->right : grand->left;
+        if (is_red(uncle)) {
+            parent->red = uncle->red = false;
+            grand->red = true;
+            node = grand;
+            continue;
+        }
+        if (parent == grand->left) {
+            if (node == parent->right) {
+                rotate_left(ar, parent);
+                parent = node;
+            }
+            rotate_right(ar, grand);
+        } else {
+            if (node == parent->left) {
+                rotate_right(ar, parent);
+                parent = node;
+            }
+            rotate_left(ar, grand);
+        }
+        parent->red = false;
+        grand->red = true;
+        break;
+    }
+    ar->tree_root->red = false;
+}
+
+/* This function restores the black height after a black node was taken
+ * out above node (which may be NULL), whose parent is given.
+ */
+void remove_fixup(arena *ar, treenode *node, treenode *parent) {
+    while (node != ar->tree_root && !is_red(node)) {
+        if (node == parent->left) {
+            treenode *sibling = parent->right;
+            if (sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                rotate_left(ar, parent);
+                sibling = parent->right;
+            }
+            if (!is_red(sibling->left) && !is_red(sibling->right)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (!is_red(sibling->right)) {
+                sibling->left->red = false;
+                sibling->red = true;
+                rotate_right(ar, sibling);
+                sibling = parent->right;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            rotate_left(ar, parent);
+        } else {
+            treenode *sibling = parent->left;
+            if (sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                rotate_right(ar, parent);
+                sibling = parent->left;
+            }
+            if (!is_red(sibling->left) && !is_red(sibling->right)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (!is_red(sibling->left)) {
+                sibling->right->red = false;
+                sibling->red = true;
+                rotate_left(ar, sibling);
+                sibling = parent->left;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            rotate_right(ar, parent);
+        }
+        node = ar->tree_root;
+    }
+    if (node != NULL) node->red = false;
+}
+
+/* This function takes node out of the tree. A node with two children
+ * is replaced by its successor, the leftmost node of its right subtree.
+ */
+void tree_remove(arena *ar, treenode *node) {
+    treenode *child, *parent;
+    bool removed_red;
+    decay_unlink(ar, node);
+    if (node->left == NULL || node->right == NULL) {
+        child = node->left != NULL ? node->left : node->right;
+        parent = node->parent;
+        removed_red = node->red;
+        replace_child(ar, parent, node, child);
+        if (child != NULL) child->parent = parent;
+    } else {
+        treenode *next = node->right;
+        while (next->left != NULL) {
+            next = next->left;
+        }
+        removed_red = next->red;
+        child = next->right;
+        if (next->parent == node) {
+            parent = next;
+        } else {
+            parent = next->parent;
+            parent->left = child;
+            if (child != NULL) child->parent = parent;
+            next->right = node->right;
+            next->right->parent = next;
+        }
+        next->left = node->left;
+        next->left->parent = next;
+        next->parent = node->parent;
+        replace_child(ar, node->parent, node, next);
+        next->red = node->red;
+    }
+    if (!removed_red) remove_fixup(ar, child, parent);
+}
+
+//This function returns the node before node in the tree's order, or NULL.
+treenode *tree_prev(treenode *node) {
+    if (node->left != NULL) {
+        node = node->left;
+        while (node->right != NULL) {
+            node = node->right;
+        }
+        return node;
+    }
+    while (node->parent != NULL && node == node->parent->left) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+/* This function returns the smallest block in the tree that can hold
+ * needed bytes, the lowest one of them if several have that size, or
+ * NULL if there is none.
+ */
+header *tree_find(arena *ar, size_t needed) {
+    treenode *fit = NULL;
+    treenode *node = ar->tree_root;
+    while (node != NULL) {
+        STAT(ar->stats.search_steps++);
+        if (needed <= get_size(tree_header(node))) {
+            fit = node;
+            node = node->left;
+        } else node = node->right;
+    }
+    return fit != NULL ? tree_header(fit) : NULL;
+}
+
+/* This function returns the whole pages of the free block hdr that
+ * purging may give back: all of its payload but the tree node at the
+ * start and the footer at the end. Blocks outside the tree have none.
+ */
+extent purgeable(header *hdr) {
+    char *from = (char *)addpad((uintptr_t)((char *)hdr + HEADER_SIZE + sizeof(treenode)), page_size);
+    char *to = (char *)((uintptr_t)((char *)next_header(hdr) - FOOTER_SIZE) & ~(page_size - 1));
+    if (get_size(hdr) <= TREE_MIN_SIZE || from >= to) return (extent){NULL, NULL};
+    return (extent){from, to};
+}
+
+//This function returns what the free block hdr knows of its pages; a list block knows nothing.
+page_state block_state(arena *ar, header *hdr) {
+    if (get_size(hdr) <= TREE_MIN_SIZE) return (page_state){ar->ops, {NULL, NULL}};
+    return ((treenode *)header_to_node(hdr))->pages;
+}
+
+/* This function merges what is known of two free blocks of the given
+ * sizes about to become one: the larger one's age and the larger of
+ * their zero ranges. A small block freed next to a big idle one thus
+ * does not keep the big one from being purged.
+ */
+void merge_state(page_state *into, size_t into_size, page_state other, size_t other_size) {
+    if (other_size > into_size) into->dirty_at = other.dirty_at;
+    if (other.clean.to - other.clean.from > into->clean.to - into->clean.from) into->clean = other.clean;
+}
+
+/* This function hands state to the free block hdr, just put in the
+ * tree, keeping only the zero pages inside its purgeable ones. Nothing
+ * may have written to those since they were known to be zero.
+ */
+void note_state(header *hdr, page_state state) {
+    if (get_size(hdr) <= TREE_MIN_SIZE) return;
+    extent room = purgeable(hdr);
+    if (state.clean.from < room.from) state.clean.from = room.from;
+    if (state.clean.to > room.to) state.clean.to = room.to;
+    if (state.clean.from >= state.clean.to) state.clean = (extent){NULL, NULL};
+    ((treenode *)header_to_node(hdr))->pages = state;
+}
+
+/* This function gives back the pages in [from, to) with MADV_DONTNEED,
+ * after which they read as zero (chunks are private anonymous memory,
+ * and so is a segment that gets purged). MADV_FREE would be cheaper but promises nothing
+ * about what they read until the kernel takes them. Returns false if
+ * the kernel refused.
+ */
+bool purge_pages(arena *ar, char *from, char *to) {
+    if (from >= to) return true;
+    STAT(ar->stats.purges++);
+    STAT(ar->stats.purged_bytes += to - from);
+    return madvise(from, to - from, MADV_DONTNEED) == 0;
+}
+
+//This function puts node, just put in the tree, at the new end of ar's decay list.
+void decay_push(arena *ar, treenode *node) {
+    node->older = ar->decay_newest;
+    node->newer = NULL;
+    if (node->older != NULL) {
+        node->older->newer = node;
+    } else ar->decay_oldest = node;
+    ar->decay_newest = node;
+    node->queued = true;
+}
+
+//This function takes node off ar's decay list, if it is on it.
+void decay_unlink(arena *ar, treenode *node) {
+    if (!node->queued) return;
+    if (node->older != NULL) {
+        node->older->newer = node->newer;
+    } else ar->decay_oldest = node->newer;
+    if (node->newer != NULL) {
+        node->newer->older = node->older;
+    } else ar->decay_newest = node->older;
+    node->queued = false;
+}
+
+/* This function purges the blocks at the old end of ar's decay list
+ * that have gone PURGE_DECAY operations without taking in dirty
+ * memory, and takes them off it, so a block is purged at most once
+ * each time it goes into the tree. It stops at the first block that is
+ * too young. A merged block can keep the age of an older neighbor and
+ * so wait behind younger ones, but never more than PURGE_DECAY further
+ * operations. Only the pages not already known to be zero are given
+ * back, and in the segment nothing past where the heap has ever
+ * reached, unless that joins them to zero pages further on (a block
+ * keeps one zero range). A segment given to myinit may not be private
+ * anonymous memory, so its blocks are never purged.
+ */
+void purge_decayed(arena *ar) {
+    treenode *node;
+    while ((node = ar->decay_oldest) != NULL && ar->ops - node->pages.dirty_at >= PURGE_DECAY) {
+        decay_unlink(ar, node);
+        header *hdr = tree_header(node);
+        extent room = purgeable(hdr);
+        char *reach = (char *)ar->start + ar->nused;
+        if (in_segment(hdr) && !segment_anonymous) continue;
+        if (in_segment(hdr) && room.to > reach) {
+            room.to = (char *)((uintptr_t)reach & ~(page_size - 1));
+        }
+        if (room.from >= room.to) continue;
+        extent clean = node->pages.clean;
+        if (clean.from == NULL) { //a zero range lies inside purgeable, so never before room
+            if (purge_pages(ar, room.from, room.to)) node->pages.clean = room;
+        } else if (purge_pages(ar, room.from, clean.from) && purge_pages(ar, clean.to, room.to)) {
+            node->pages.clean.from = room.from < clean.from ? room.from : clean.from;
+            node->pages.clean.to = room.to > clean.to ? room.to : clean.to;
+        }
+    }
+}
+
+//This function purges whatever has decayed, and is called every PURGE_INTERVAL operations.
+void purge_arena(arena *ar) {
+    ar->next_purge = ar->ops + PURGE_INTERVAL;
+    purge_decayed(ar);
+}
+
+#ifdef NEXT_FIT
+/* This function returns the first block in the given range class that
+ * can hold needed bytes, starting at the class's rover and going round
+ * to its head, or NULL if there is none. The rover is left on the block,
+ * and moves past it when the block is taken off the list.
+ */
+header *search_bin(arena *ar, int bin, size_t needed) {
+    listnode *start = ar->rovers[bin] != NULL ? ar->rovers[bin] : ar->bins[bin];
+    if (start == NULL) return NULL;
+    listnode *node = start;
+    do {
+        header *hdr = node_to_header(node);
+        STAT(ar->stats.search_steps++);
+        if (needed <= get_size(hdr)) {
+            ar->rovers[bin] = node;
+            return hdr;
+        }
+        node = node_next(node) != NULL ? node_next(node) : ar->bins[bin];
+    } while (node != start);
+    return NULL;
+}
+#else
+/* This function returns a block in the given range class that can hold
+ * needed bytes, or NULL if there is none. With FIT_CANDIDATES of 1 that
+ * is the first one; otherwise the smallest of the first FIT_CANDIDATES
+ * that fit, or one that fits so closely it will not be split.
+ */
+header *search_bin(arena *ar, int bin, size_t needed) {
+    header *fit = NULL;
+    int found = 0;
+    for (listnode *node = ar->bins[bin]; node != NULL; node = node_next(node)) {
+        header *hdr = node_to_header(node);
+        STAT(ar->stats.search_steps++);
+        if (needed > get_size(hdr)) continue;
+        if (fit == NULL || get_size(hdr) < get_size(fit)) fit = hdr;
+        if (++found == FIT_CANDIDATES || get_size(hdr) - needed < MIN_BLOCK) break;
+    }
+    return fit;
+}
+#endif
+
+/* This function `coalesces` the free block hdr, which must not be on
+ * a freelist, with the free blocks on either side of it. Neighbors
+ * are taken off their freelists and the header of the merged block
+ * is returned. Since two free blocks are never left next to each
+ * other, there is at most one neighbor on each side.
+ */
+header *coalesce(arena *ar, header *hdr, page_state *state) {
+    header *neighbor = next_header(hdr);
+    if ((void *)neighbor != ar->end && !is_used(neighbor)) {
+        merge_state(state, get_size(hdr), block_state(ar, neighbor), get_size(neighbor));
+        remove_node(ar, header_to_node(neighbor));
+        hdr->size += HEADER_SIZE + get_size(neighbor);
+        ar->num_header--; //we lose a header
+        STAT(ar->stats.coalesces++);
+    }
+    if (hdr->size & PREV_FREE) {
+        header *left = prev_header(hdr);
+        merge_state(state, get_size(hdr), block_state(ar, left), get_size(left));
+        remove_node(ar, header_to_node(left));
+        left->size += HEADER_SIZE + get_size(hdr);
+        ar->num_header--;
+        STAT(ar->stats.coalesces++);
+        hdr = left;
+    }
+    return hdr;
+}
+
+/* This function splits the tail off a block that is larger than
+ * needed, as long as the tail can hold a header, a list node and
+ * a footer, and adds the tail to the freelists. The flag bits of
+ * hdr are kept and hdr is treated as in use by the tail, which
+ * takes over state, what was known of hdr's pages.
+ */
+void split_block(arena *ar, header *hdr, size_t needed, page_state state) {
+    size_t size = get_size(hdr);
+    if (size - needed < MIN_BLOCK) return;
+    hdr->size = needed | (hdr->size & FLAG_BITS);
+    STAT(ar->stats.splits++);
+
+    //attach new free header after the shrunk block
+    header *new_hdr = next_header(hdr);
+    new_hdr->size = size - needed - HEADER_SIZE;
+    ar->num_header += 1;
+    new_hdr = coalesce(ar, new_hdr, &state);
+    mark_free(ar, new_hdr);
+    add_to_beg(ar, new_hdr);
+    note_state(new_hdr, state);
+
+    //keep track of how far into the segment the heap reaches
+    size_t reach = (char *)new_hdr - (char *)ar->start + MIN_BLOCK;
+    if (next_header(new_hdr) == ar->end && reach > ar->nused) ar->nused = reach;
+}
+
+/* This function finds a free block of at least needed bytes. Because
+ * it is an explicit implementation, it only looks at free nodes: the
+ * exact size class is taken straight from its list, a range class is
+ * searched with search_bin and the tree with tree_find, and otherwise
+ * the first non-empty larger class (found with the bitmap) is used.
+ * Every block there fits, so first fit takes the head of a list; the
+ * other policies still search it if it is a range class, and the tree
+ * always gives its smallest block. Returns NULL if nothing fits.
+ */
+header *find_fit(arena *ar, size_t needed) {
+    STAT(ar->stats.searches++);
+    int bin = find_bin(needed);
+    if (bin == TREE_BIN) return tree_find(ar, needed); //there is no larger class
+    if (bin >= NUM_EXACT_BINS) {
+        header *hdr = search_bin(ar, bin, needed);
+        if (hdr != NULL) return hdr;
+        bin++; //any larger class fits without searching
+    }
+    unsigned long avail = bin < NUM_BINS ? ar->bin_map & (~0UL << bin) : 0;
+    if (avail == 0) return NULL;
+    bin = __builtin_ctzl(avail);
+    if (bin == TREE_BIN) return tree_find(ar, needed);
+#if FIT_CANDIDATES > 1 || defined(NEXT_FIT)
+    if (bin >= NUM_EXACT_BINS) return search_bin(ar, bin, needed);
+#endif
+    return node_to_header(ar->bins[bin]);
+}
+
+/* This function splits needed bytes off the front of the tree block hdr
+ * and moves its tree node to the rest, when the rest still belongs in the
+ * tree and still sorts after the node before it. That saves taking the
+ * block out and putting the rest back in, with their rotations, every
+ * time a small request is cut from the big block at the end of the heap.
+ * The rest has a used block after it, so there is nothing to coalesce.
+ * Returns false, changing nothing, if the rest would have to move.
+ */
+bool tree_split(arena *ar, header *hdr, size_t needed) {
+    size_t size = get_size(hdr);
+    if (size <= needed + HEADER_SIZE + TREE_MIN_SIZE) return false; //also true of blocks not in the tree
+    size_t rest = size - needed - HEADER_SIZE;
+    treenode *old = (treenode *)header_to_node(hdr);
+    header *new_hdr = (header *)((char *)hdr + HEADER_SIZE + needed);
+    treenode *node = (treenode *)header_to_node(new_hdr);
+    treenode *prev = tree_prev(old);
+    //a rest of prev's size still sorts after it if it lies above it, as ties go by address
+    size_t prev_size = prev != NULL ? get_size(tree_header(prev)) : 0;
+    if (prev != NULL && (prev_size > rest || (prev_size == rest && prev > node))) return false;
+
+    treenode moved = *old; //the two nodes may overlap
+    hdr->size = needed | (hdr->size & FLAG_BITS);
+    new_hdr->size = rest;
+    *node = moved;
+    note_state(new_hdr, moved.pages); //the pages under the new node are not zero any more
+    if (moved.queued) { //its neighbors on the decay list still point at old
+        if (moved.older != NULL) {
+            moved.older->newer = node;
+        } else ar->decay_oldest = node;
+        if (moved.newer != NULL) {
+            moved.newer->older = node;
+        } else ar->decay_newest = node;
+    }
+    replace_child(ar, moved.parent, old, node);
+    if (moved.left != NULL) moved.left->parent = node;
+    if (moved.right != NULL) moved.right->parent = node;
+    ar->num_header += 1;
+    STAT(ar->stats.splits++);
+    mark_free(ar, new_hdr);
+
+    size_t reach = (char *)new_hdr - (char *)ar->start + MIN_BLOCK;
+    if (next_header(new_hdr) == ar->end && reach > ar->nused) ar->nused = reach;
+    return true;
+}
+
+/* This function takes a block found by find_fit and hands out needed
+ * bytes of it, noting in handed_zero which of them read as zero.
+ */
+void *alloc_block(arena *ar, header *curhdr, size_t needed) {
+    ar->ops++;
+    char *payload = (char *)curhdr + HEADER_SIZE;
+    extent zero = block_state(ar, curhdr).clean;
+    if (zero.from < payload) zero.from = payload;
+    if (zero.to > payload + needed) zero.to = payload + needed;
+    ar->handed_zero = zero.from < zero.to ? zero : (extent){NULL, NULL};
+    if (!tree_split(ar, curhdr, needed)) {
+        page_state state = block_state(ar, curhdr);
+        remove_node(ar, header_to_node(curhdr));
+        split_block(ar, curhdr, needed, state);
+    }
+    add_in_use(ar, get_size(curhdr));
+    count_small(ar, curhdr, 1);
+    mark_used(ar, curhdr);
+    note_reach(ar, curhdr);
+    return payload;
+}
+
+/* This function hands out up to n blocks of needed bytes each, cut one
+ * after another from the front of the free block find_fit picks for
+ * one of them, and puts them in out. The placement policy decides as
+ * it does for mymalloc, so a block of the exact size is still used up
+ * first, but a larger one gives all the blocks it can hold in one
+ * pass: only the last of them is split, so the tail goes back to the
+ * freelists once. Returns how many blocks it handed out.
+ */
+size_t carve_blocks(arena *ar, size_t needed, size_t n, void *out[]) {
+    size_t stride = HEADER_SIZE + needed;
+    header *hdr = find_fit(ar, needed);
+    if (hdr == NULL && grow_arena(ar, needed)) hdr = find_fit(ar, needed);
+    if (hdr == NULL) return 0;
+
+    size_t k = (get_size(hdr) + HEADER_SIZE) / stride;
+    if (k > n) k = n;
+    page_state state = block_state(ar, hdr);
+    remove_node(ar, header_to_node(hdr));
+    size_t rest = get_size(hdr) - (k - 1) * stride; //what the last block starts with
+    unsigned long flags = hdr->size & FLAG_BITS;
+    for (size_t i = 0; i + 1 < k; i++) {
+        hdr->size = needed | flags | USED_BIT;
+        out[i] = (char *)hdr + HEADER_SIZE;
+        hdr = next_header(hdr);
+        flags = 0; //the block before is the one just handed out
+    }
+    hdr->size = rest | flags;
+    split_block(ar, hdr, needed, state);
+    mark_used(ar, hdr);
+    note_reach(ar, hdr);
+    out[k - 1] = (char *)hdr + HEADER_SIZE;
+
+    ar->ops += k;
+    ar->num_header += k - 1;
+    add_in_use(ar, (k - 1) * needed + get_size(hdr));
+    STAT(ar->stats.splits += k - 1);
+    return k;
+}
+
+/* This function allocates a block of needed bytes that starts offset
+ * bytes before a multiple of align: a slab's header lies on a
+ * SLAB_SIZE boundary, and mymemalign's payload on its alignment. It
+ * asks for enough extra room that the aligned spot, a block of leading
+ * slack and a block of trailing slack always fit, so the block is split
+ * to exactly needed bytes, as a slab must be, and both slacks go back
+ * to the freelists. Returns NULL if nothing fits.
+ */
+header *alloc_aligned(arena *ar, size_t needed, size_t align, size_t offset) {
+    header *hdr = find_fit(ar, needed + align + 2 * MIN_BLOCK);
+    if (hdr == NULL) return NULL;
+    remove_node(ar, header_to_node(hdr));
+
+    uintptr_t aligned = addpad((uintptr_t)hdr + offset, align) - offset;
+    while (aligned != (uintptr_t)hdr && aligned - (uintptr_t)hdr < MIN_BLOCK) {
+        aligned += align;
+    }
+    if (aligned != (uintptr_t)hdr) { //leading slack becomes a free block of its own
+        header *block = (header *)aligned;
+        block->size = get_size(hdr) - (aligned - (uintptr_t)hdr);
+        hdr->size = ((aligned - (uintptr_t)hdr) - HEADER_SIZE) | (hdr->size & FLAG_BITS);
+        ar->num_header += 1;
+        mark_free(ar, hdr);
+        add_to_beg(ar, hdr);
+        hdr = block;
+    }
+    split_block(ar, hdr, needed, (page_state){ar->ops, {NULL, NULL}});
+    add_in_use(ar, get_size(hdr));
+    mark_used(ar, hdr);
+    note_reach(ar, hdr);
+    return hdr;
+}
+
+//This function finds the slab map covering ptr, in the segment or in its chunk, and ptr's granule in it.
+unsigned char *slab_map_of(void *ptr, uintptr_t *granule) {
+    *granule = ((uintptr_t)ptr >> SLAB_SHIFT) - first_granule;
+    if (*granule < num_granules) return slab_map; //also catches ptr below the segment
+    *granule = ((uintptr_t)ptr & (CHUNK_SIZE - 1)) >> SLAB_SHIFT;
+    return chunk_of(ptr)->slab_map;
+}
+
+//These functions tell whether ptr lies in a slab granule and find that slab.
+bool in_slab(void *ptr) {
+    uintptr_t granule;
+    unsigned char *map = slab_map_of(ptr, &granule);
+    //relaxed atomics: myfree reads this without the lock while other bits of the byte change
+    return (__atomic_load_n(&map[granule >> 3], __ATOMIC_RELAXED) >> (granule & 7)) & 1;
+}
+
+slab *slab_of(void *ptr) {
+    return (slab *)(((uintptr_t)ptr & ~(SLAB_SIZE - 1)) + HEADER_SIZE);
+}
+
+void set_slab_bit(slab *s, bool on) {
+    uintptr_t granule;
+    unsigned char *map = slab_map_of(s, &granule);
+    if (on) {
+        __atomic_fetch_or(&map[granule >> 3], 1 << (granule & 7), __ATOMIC_RELAXED);
+    } else __atomic_fetch_and(&map[granule >> 3], ~(1 << (granule & 7)), __ATOMIC_RELAXED);
+}
+
+//These functions keep the per-class list of partial slabs.
+void push_partial(arena *ar, slab *s, int cls) {
+    s->prev = NULL;
+    s->nxt = ar->partial[cls];
+    if (s->nxt != NULL) s->nxt->prev = s;
+    ar->partial[cls] = s;
+}
+
+void remove_partial(arena *ar, slab *s, int cls) {
+    if (s->prev == NULL) {
+        ar->partial[cls] = s->nxt;
+    } else s->prev->nxt = s->nxt;
+    if (s->nxt != NULL) s->nxt->prev = s->prev;
+}
+
+/* This function carves a new slab for class cls out of the heap and
+ * marks every slot free. Returns NULL if no aligned block is left.
+ */
+slab *new_slab(arena *ar, int cls) {
+    header *hdr = alloc_aligned(ar, SLAB_SIZE - HEADER_SIZE, SLAB_SIZE, 0);
+    if (hdr == NULL) return NULL;
+    slab *s = (slab *)((char *)hdr + HEADER_SIZE);
+    s->obj_size = slab_sizes[cls];
+    s->nfree = (SLAB_SIZE - SLAB_OBJ_START) / s->obj_size;
+    memset(s->free_map, 0, sizeof(s->free_map));
+    for (unsigned int i = 0; i < s->nfree; i++) {
+        s->free_map[i >> 6] |= 1UL << (i & 63);
+    }
+    set_slab_bit(s, true);
+    push_partial(ar, s, cls);
+    return s;
+}
+
+/* This function hands out the first free slot of a partial slab of
+ * the request's class, found with find-first-set on the slab bitmap.
+ * Returns NULL if no slab can be had, so the caller falls back to an
+ * ordinary block.
+ */
+void *slab_alloc(arena *ar, size_t requested_size) {
+    int cls = slab_class[(requested_size + ALIGNMENT - 1) >> 3];
+    slab *s = ar->partial[cls];
+    if (s == NULL && (ar->small_live < SLAB_MIN_LIVE || (s = new_slab(ar, cls)) == NULL)) return NULL;
+
+    int w = 0;
+    while (s->free_map[w] == 0) w++;
+    int slot = (w << 6) + __builtin_ctzl(s->free_map[w]);
+    s->free_map[w] &= s->free_map[w] - 1; //clear lowest set bit
+    if (--s->nfree == 0) remove_partial(ar, s, cls);
+    return (char *)s - HEADER_SIZE + SLAB_OBJ_START + (size_t)slot * s->obj_size;
+}
+
+/* This function gives a slot back to its slab. A slab that becomes
+ * empty goes back to the heap, unless it is the only partial slab of
+ * its class (so alternating malloc/free does not carve it again).
+ */
+void slab_free(arena *ar, void *ptr) {
+    slab *s = slab_of(ptr);
+    int cls = slab_class[s->obj_size >> 3];
+    size_t slot = ((char *)ptr - ((char *)s - HEADER_SIZE + SLAB_OBJ_START)) / s->obj_size;
+    s->free_map[slot >> 6] |= 1UL << (slot & 63);
+    if (s->nfree++ == 0) push_partial(ar, s, cls);
+
+    if (s->nfree == (SLAB_SIZE - SLAB_OBJ_START) / s->obj_size &&
+        (ar->partial[cls] != s || s->nxt != NULL)) {
+        remove_partial(ar, s, cls);
+        set_slab_bit(s, false);
+        free_block(ar, (header *)((char *)s - HEADER_SIZE));
+    }
+}
+
+//This function tells whether ptr is in a chunk or the segment, as every block but a mapped one is.
+bool in_heap(void *ptr) {
+    return in_segment(ptr) || chunk_of(ptr) != NULL;
+}
+
+header *mapping_header(mapping *m) {
+    return (header *)((char *)m + sizeof(mapping));
+}
+
+mapping *header_mapping(header *hdr) {
+    return (mapping *)((char *)hdr - sizeof(mapping));
+}
+
+//This function returns the start of m's mapping, the page the record lies in.
+char *mapping_base(mapping *m) {
+    return (char *)((uintptr_t)m & ~(page_size - 1));
+}
+
+/* This function gives a block of needed bytes a mapping of its own
+ * and returns its payload, which lies on a multiple of align, or NULL
+ * if the mapping fails. The payload starts as early in the first page
+ * as align allows; for an alignment of more than a page, the mapping
+ * is made that much longer and trimmed so the payload starts a page in
+ * at the right address. No arena lock is needed.
+ */
+void *map_block(size_t needed, size_t align) {
+    size_t lead = addpad(sizeof(mapping) + HEADER_SIZE, align < page_size ? align : page_size);
+    size_t length = addpad(lead + needed, page_size);
+    size_t extra = align > page_size ? align - page_size : 0;
+    char *base = mmap(NULL, length + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+    if (extra != 0) {
+        char *map = base;
+        base = (char *)addpad((uintptr_t)map + lead, align) - lead;
+        if (base != map) munmap(map, base - map);
+        if (base != map + extra) munmap(base + length, map + extra - base);
+    }
+    mapping *m = (mapping *)(base + lead - HEADER_SIZE - sizeof(mapping));
+    m->length = length;
+    header *hdr = mapping_header(m);
+    hdr->size = (length - lead) | USED_BIT | MAPPED_BIT;
+
+    pthread_mutex_lock(&mapping_lock);
+    m->prev = NULL;
+    m->nxt = mappings;
+    if (mappings != NULL) mappings->prev = m;
+    mappings = m;
+    mapped_bytes += get_size(hdr);
+    num_mappings++;
+    pthread_mutex_unlock(&mapping_lock);
+    return (char *)hdr + HEADER_SIZE;
+}
+
+//This function unmaps a mapped block, dropping its sample if it has one.
+void unmap_block(header *hdr) {
+    if (hdr->size & SAMPLED_BIT) forget_sample(hdr);
+    mapping *m = header_mapping(hdr);
+    pthread_mutex_lock(&mapping_lock);
+    if (m->prev != NULL) {
+        m->prev->nxt = m->nxt;
+    } else mappings = m->nxt;
+    if (m->nxt != NULL) m->nxt->prev = m->prev;
+    mapped_bytes -= get_size(hdr);
+    num_mappings--;
+    pthread_mutex_unlock(&mapping_lock);
+    munmap(mapping_base(m), m->length);
+}
+
+//This function looks ptr up among the chunks and then the mapped blocks.
+bool mymapped(void *ptr) {
+    if (chunk_of(ptr) != NULL) return true;
+    pthread_mutex_lock(&mapping_lock);
+    mapping *m = mappings;
+    while (m != NULL && (char *)mapping_header(m) + HEADER_SIZE != (char *)ptr) {
+        m = m->nxt;
+    }
+    pthread_mutex_unlock(&mapping_lock);
+    return m != NULL;
+}
+
+/* This function resizes a mapped block. mremap grows or shrinks the
+ * mapping in place when it can and otherwise moves its pages, so the
+ * payload is never copied. A block shrunk below MMAP_THRESHOLD goes
+ * back to the heap. Returns NULL, leaving the block alone, on failure.
+ */
+void *realloc_mapped(void *old_ptr, size_t new_size) {
+    header *hdr = (header *)((char *)old_ptr - HEADER_SIZE);
+    if (new_size > MAX_REQUEST_SIZE) return NULL;
+    if (hdr->size & SAMPLED_BIT) forget_sample(hdr); //the block is no longer the one sampled
+    if (new_size < MMAP_THRESHOLD) {
+        void *ptr = mymalloc(new_size);
+        if (ptr == NULL) return NULL;
+        memcpy(ptr, old_ptr, new_size);
+        unmap_block(hdr);
+        return ptr;
+    }
+    mapping *m = header_mapping(hdr);
+    char *base = mapping_base(m);
+    size_t lead = (char *)old_ptr - base;
+    size_t length = addpad(lead + addpad(new_size, ALIGNMENT), page_size);
+    if (length == m->length) return old_ptr;
+
+    //the list is locked while the record may move under it
+    pthread_mutex_lock(&mapping_lock);
+    char *moved_base = mremap(base, m->length, length, MREMAP_MAYMOVE);
+    if (moved_base == MAP_FAILED) {
+        pthread_mutex_unlock(&mapping_lock);
+        return NULL;
+    }
+    mapping *moved = (mapping *)(moved_base + ((char *)m - base));
+    mapped_bytes += length - moved->length;
+    moved->length = length;
+    if (moved->prev != NULL) {
+        moved->prev->nxt = moved;
+    } else mappings = moved;
+    if (moved->nxt != NULL) moved->nxt->prev = moved;
+    hdr = mapping_header(moved);
+    hdr->size = (length - lead) | USED_BIT | MAPPED_BIT;
+    pthread_mutex_unlock(&mapping_lock);
+    return (char *)hdr + HEADER_SIZE;
+}
+
+/* This function taken in a requested size and allocates memory
+ * in arena ar, with its lock held. Small requests come from a
+ * slab of their class; everything else (or a small request when no
+ * slab can be carved) gets an ordinary block from the size-class
+ * freelists. If there are no more free space, a NULL ptr is returned.
+ */
+void *heap_malloc(arena *ar, size_t requested_size) {
+    drain_remote(ar);
+    if (requested_size <= SLAB_MAX_SIZE) {
+        void *ptr = slab_alloc(ar, requested_size);
+        if (ptr != NULL) return ptr;
+    }
+    //align requested_size
+    size_t needed = addpad(requested_size, ALIGNMENT);
+    if (needed < MIN_PAYLOAD) needed = MIN_PAYLOAD;
+
+    header *curhdr = find_fit(ar, needed);
+    if (curhdr == NULL && grow_arena(ar, needed)) curhdr = find_fit(ar, needed);
+    if (curhdr == NULL) return NULL;
+    return alloc_block(ar, curhdr, needed);
+}
+
+/* This function frees an ordinary block, which coalesces with its
+ * neighbor blocks on both sides if they are also free.
+ */
+void free_block(arena *ar, header *hdr) {
+    if (hdr->size & SAMPLED_BIT) forget_sample(hdr);
+    count_small(ar, hdr, -1);
+    hdr->size ^= USED_BIT;
+    add_in_use(ar, -(long)get_size(hdr));
+
+    page_state state = {ar->ops, {NULL, NULL}};
+    hdr = coalesce(ar, hdr, &state);
+    mark_free(ar, hdr);
+    add_to_beg(ar, hdr);
+    note_state(hdr, state);
+}
+
+/* This function frees the m allocated blocks at ptrs, sorted by
+ * address, as far as they lie back to back in memory from ptrs[0] on:
+ * the run merges into one block, which coalesces and goes on a
+ * freelist once. Returns how many blocks the run took.
+ */
+size_t free_run(arena *ar, void *ptrs[], size_t m) {
+    header *hdr = (header *)((char *)ptrs[0] - HEADER_SIZE);
+    header *cur = hdr;
+    size_t count = 0;
+    while (true) {
+        if (cur->size & SAMPLED_BIT) forget_sample(cur);
+        count_small(ar, cur, -1);
+        add_in_use(ar, -(long)get_size(cur));
+        header *next = next_header(cur);
+        if (cur != hdr) {
+            hdr->size += HEADER_SIZE + get_size(cur);
+            ar->num_header--;
+            STAT(ar->stats.coalesces++);
+        }
+        count++;
+        if (count == m || (void *)next == ar->end || (char *)ptrs[count] != (char *)next + HEADER_SIZE) break;
+        cur = next;
+    }
+    hdr->size ^= USED_BIT;
+
+    page_state state = {ar->ops, {NULL, NULL}};
+    hdr = coalesce(ar, hdr, &state);
+    mark_free(ar, hdr);
+    add_to_beg(ar, hdr);
+    note_state(hdr, state);
+    return count;
+}
+
+/*
+ *Takes care of freeing block at the pointer address, which is
+ * either a slab slot or an ordinary block. The arena's lock is held.
+ */
+void heap_free(arena *ar, void *ptr) {
+    if (in_slab(ptr)) {
+        slab_free(ar, ptr);
+    } else free_block(ar, (header *)((char *)ptr - HEADER_SIZE));
+    if (++ar->ops >= ar->next_purge) purge_arena(ar);
+}
+
+/* This function hands the chain of blocks from first to last, linked
+ * through their first word, to arena ar without taking its lock. Any
+ * number of threads may push at once; the chain is freed by the next
+ * drain_remote.
+ */
+void push_remote(arena *ar, void *first, void *last) {
+    void *head = __atomic_load_n(&ar->remote_frees, __ATOMIC_RELAXED);
+    do {
+        *(void **)last = head;
+    } while (!__atomic_compare_exchange_n(&ar->remote_frees, &head, first, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* This function frees every block pushed onto ar by push_remote, with
+ * its lock held. The whole list is taken with one exchange, so there is no
+ * ABA problem, and it is reversed first so blocks are freed in the
+ * order they were pushed.
+ */
+void drain_remote(arena *ar) {
+    if (__atomic_load_n(&ar->remote_frees, __ATOMIC_RELAXED) == NULL) return;
+    void *ptr = __atomic_exchange_n(&ar->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    void *oldest = NULL;
+    while (ptr != NULL) {
+        void *nxt = *(void **)ptr;
+        *(void **)ptr = oldest;
+        oldest = ptr;
+        ptr = nxt;
+    }
+    while (oldest != NULL) {
+        void *nxt = *(void **)oldest;
+        heap_free(ar, oldest);
+        oldest = nxt;
+    }
+}
+
+/* This function grows the allocated block hdr to at least needed bytes
+ * without moving it elsewhere: it takes in the free block after it and,
+ * if that is not enough, the free block before it as well, sliding the
+ * payload down with memmove. Only the block's own bytes are moved.
+ * Returns the header of the grown block, or NULL, changing nothing, if
+ * its neighbors are too small.
+ */
+header *grow_in_place(arena *ar, header *hdr, size_t needed) {
+    size_t size = get_size(hdr);
+    size_t avail = size;
+    header *right = next_header(hdr);
+    if ((void *)right != ar->end && !is_used(right)) {
+        avail += HEADER_SIZE + get_size(right);
+    } else right = NULL;
+    header *left = NULL;
+    if (avail < needed && (hdr->size & PREV_FREE)) {
+        left = prev_header(hdr);
+        avail += HEADER_SIZE + get_size(left);
+    }
+    if (avail < needed) return NULL;
+
+    count_small(ar, hdr, -1);
+    if (right != NULL) {
+        remove_node(ar, header_to_node(right));
+        ar->num_header--;
+        STAT(ar->stats.coalesces++);
+    }
+    if (left != NULL) {
+        remove_node(ar, header_to_node(left));
+        ar->num_header--;
+        STAT(ar->stats.coalesces++);
+        memmove((char *)left + HEADER_SIZE, (char *)hdr + HEADER_SIZE, size);
+        STAT(ar->stats.realloc_copied += size);
+        hdr = left;
+    }
+    hdr->size = avail | (hdr->size & FLAG_BITS);
+    add_in_use(ar, avail - size);
+    mark_used(ar, hdr);
+    count_small(ar, hdr, 1);
+    return hdr;
+}
+
+/* This function reallocates memory given a new size in arena ar, with
+ * its lock held. A block that is too small grows in place with
+ * grow_in_place if its neighbors allow, and otherwise moves to a new
+ * block with only its old payload copied. Either way the block is then
+ * cut down to the new size, and the tail goes back to the freelists,
+ * so shrinking gives memory back too.
+ */
+void *heap_realloc(arena *ar, void *old_ptr, size_t new_size) {
+    drain_remote(ar);
+    if (in_slab(old_ptr)) { //slots cannot grow, so move to a bigger one
+        size_t obj_size = slab_of(old_ptr)->obj_size;
+        if (obj_size >= new_size) {
+            STAT(ar->stats.realloc_in_place++);
+            return old_ptr;
+        }
+        void *moved_ptr = heap_malloc(ar, new_size);
+        if (!moved_ptr) return NULL;
+        memcpy(moved_ptr, old_ptr, obj_size);
+        STAT(ar->stats.realloc_copied += obj_size);
+        slab_free(ar, old_ptr);
+        STAT(ar->stats.realloc_moved++);
+        return moved_ptr;
+    }
+    header *curhdr = (header *)((char *)old_ptr - HEADER_SIZE);
+    if (curhdr->size & SAMPLED_BIT) forget_sample(curhdr); //the block is no longer the one sampled
+    size_t needed = addpad(new_size, ALIGNMENT);
+    if (needed < MIN_PAYLOAD) needed = MIN_PAYLOAD;
+    if (get_size(curhdr) < needed) {
+        header *grown = grow_in_place(ar, curhdr, needed);
+        if (grown == NULL) { //move the data elsewhere
+            void *moved_ptr = new_size >= MMAP_THRESHOLD && new_size <= MAX_REQUEST_SIZE ? map_block(needed, ALIGNMENT) : NULL;
+            if (!moved_ptr) moved_ptr = heap_malloc(ar, new_size);
+            if (!moved_ptr) return NULL;
+            memcpy(moved_ptr, old_ptr, get_size(curhdr));
+            STAT(ar->stats.realloc_copied += get_size(curhdr));
+            free_block(ar, curhdr);
+            STAT(ar->stats.realloc_moved++);
+            return moved_ptr;
+        }
+        curhdr = grown;
+    }
+    //cut the block down to size; the tail merges with a free block after it
+    size_t before = get_size(curhdr);
+    count_small(ar, curhdr, -1);
+    split_block(ar, curhdr, needed, (page_state){ar->ops, {NULL, NULL}});
+    note_reach(ar, curhdr);
+    add_in_use(ar, (long)get_size(curhdr) - (long)before);
+    count_small(ar, curhdr, 1);
+    STAT(ar->stats.realloc_in_place++);
+    return (char *)curhdr + HEADER_SIZE;
+}
+
+//This function runs when a thread exits and hands its cached blocks back.
+void flush_tcache(void *arg) {
+    tcache *tc = arg;
+    if (tc->epoch == __atomic_load_n(&heap_epoch, __ATOMIC_ACQUIRE)) {
+        for (int idx = 0; idx < TCACHE_CLASSES; idx++) {
+            if (tc->heads[idx] == NULL) continue;
+            void *last = tc->heads[idx];
+            while (*(void **)last != NULL) last = *(void **)last;
+            push_remote(tc->home, tc->heads[idx], last);
+        }
+        STAT(fold_thread_stats(tc));
+    }
+    memset(tc, 0, sizeof(*tc));
+}
+
+void make_tcache_key(void) {
+    pthread_key_create(&tcache_key, flush_tcache);
+}
+
+/* This function returns the calling thread's cache. If myinit has
+ * reset the heap since the cache was filled, its blocks no longer
+ * exist and the cache simply starts over, with the next arena in
+ * round-robin order as its home.
+ */
+tcache *get_tcache(void) {
+    unsigned long epoch = __atomic_load_n(&heap_epoch, __ATOMIC_ACQUIRE);
+    if (cache.epoch != epoch) {
+        if (cache.epoch == 0) {
+            pthread_once(&tcache_once, make_tcache_key);
+            pthread_setspecific(tcache_key, &cache);
+        }
+        memset(cache.heads, 0, sizeof(cache.heads));
+        memset(cache.count, 0, sizeof(cache.count));
+        memset(&cache.counted, 0, sizeof(cache.counted));
+        cache.uncounted = 0;
+        for (int idx = 0; idx < TCACHE_CLASSES; idx++) {
+            cache.batch[idx] = 1;
+        }
+        cache.home = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % num_arenas];
+        cache.epoch = epoch;
+    }
+    return &cache;
+}
+
+/* This function serves a cache miss: under the home arena's lock it
+ * allocates the requested block and, if that came from a slab, a batch
+ * of more objects of its size for the next requests. The batch starts
+ * at one object and doubles with every miss up to TCACHE_BATCH, so a
+ * size that is rarely used does not tie up objects in the cache.
+ */
+void *refill_tcache(tcache *tc, int idx, size_t requested_size) {
+    arena *ar = tc->home;
+    pthread_mutex_lock(&ar->lock);
+    void *ptr = heap_malloc(ar, requested_size);
+    if (ptr != NULL && in_slab(ptr)) {
+        int batch = tc->batch[idx];
+        if (batch < TCACHE_BATCH) tc->batch[idx] = batch * 2;
+        for (int i = 1; i < batch && tc->count[idx] < TCACHE_LIMIT; i++) {
+            void *extra = slab_alloc(ar, requested_size);
+            if (extra == NULL) break;
+            *(void **)extra = tc->heads[idx];
+            tc->heads[idx] = extra;
+            tc->count[idx]++;
+        }
+    }
+    pthread_mutex_unlock(&ar->lock);
+    return ptr;
+}
+
+/* This function is called when a cache class is full: ptr and half
+ * of the class go back to the home arena as one chain on its remote
+ * list.
+ */
+void flush_tcache_class(tcache *tc, int idx, void *ptr) {
+    void *last = ptr;
+    *(void **)ptr = tc->heads[idx];
+    while (tc->count[idx] > TCACHE_LIMIT / 2) {
+        last = *(void **)last;
+        tc->count[idx]--;
+    }
+    tc->heads[idx] = *(void **)last;
+    push_remote(tc->home, ptr, last);
+}
 
-static size_t segment_size;
-static void *segment_start;
+//This function adds the counters of from to those of to; a peak is the larger of the two.
+void add_counts(heap_stats *to, const heap_stats *from) {
+    if (from->peak_bytes_in_use > to->peak_bytes_in_use) to->peak_bytes_in_use = from->peak_bytes_in_use;
+    to->mallocs += from->mallocs;
+    to->frees += from->frees;
+    to->reallocs += from->reallocs;
+    to->failed += from->failed;
+    to->searches += from->searches;
+    to->search_steps += from->search_steps;
+    to->splits += from->splits;
+    to->coalesces += from->coalesces;
+    to->realloc_in_place += from->realloc_in_place;
+    to->realloc_moved += from->realloc_moved;
+    to->realloc_copied += from->realloc_copied;
+    to->purges += from->purges;
+    to->purged_bytes += from->purged_bytes;
+    for (int i = 0; i < STATS_SIZE_CLASSES; i++) {
+        to->size_hist[i] += from->size_hist[i];
+    }
+}
 
-static listnode *start; //always pts to beg of linked list
-static size_t nbytes_inuse; //bytes currently in use
-static int num_header;
+/* This function adds what a thread has counted without a lock to
+ * thread_totals. It runs every STATS_FOLD calls, when the thread exits
+ * and when the thread asks for mystats, so the totals never trail a
+ * thread by many calls.
+ */
+void fold_thread_stats(tcache *tc) {
+    pthread_mutex_lock(&stats_lock);
+    add_counts(&thread_totals, &tc->counted);
+    pthread_mutex_unlock(&stats_lock);
+    memset(&tc->counted, 0, sizeof(tc->counted));
+    tc->uncounted = 0;
+}
 
-static size_t nused;
-//static int countline; //for debugging purposes
+//This function counts a call in the thread's own counters (HEAP_STATS only).
+void count_call(tcache *tc, unsigned long *counter, size_t size, bool failed) {
+    stats_count(&tc->counted, counter, size, failed);
+    if (++tc->uncounted == STATS_FOLD) fold_thread_stats(tc);
+}
 
-/*
- * This function rounds up the size requested to the given multiple 
- * (must b * e a power of 2) and returns the result (taken from bump.c).
+/* This function picks how many bytes the thread allocates before its
+ * next sample. The gaps are exponentially distributed with a mean of
+ * profile_rate, so every byte is equally likely to be sampled and pprof
+ * can scale the samples back up. While the profiler is off the thread
+ * only looks again after PROFILE_IDLE_CHECK bytes.
  */
-size_t addpad(size_t size, size_t mult) {
-    return (size + mult - 1) & ~(mult - 1);
+void next_sample(tcache *tc) {
+    size_t rate = __atomic_load_n(&profile_rate, __ATOMIC_RELAXED);
+    if (rate == 0) {
+        tc->until_sample = PROFILE_IDLE_CHECK;
+        return;
+    }
+    if (tc->rng == 0) tc->rng = (uintptr_t)tc | 1;
+    tc->rng ^= tc->rng << 13; //xorshift64
+    tc->rng ^= tc->rng >> 7;
+    tc->rng ^= tc->rng << 17;
+    double u = ((tc->rng >> 11) + 1) * 0x1.0p-53; //uniform in (0, 1]
+    tc->until_sample = (long)(-log(u) * rate) + 1;
 }
 
-/* 
- * Myint is called by a client before making any allocation
- * requests.  The function returns true if initialization was 
- * successful, or false otherwise. The myinit function can be 
- * called to reset the heap to an empty state. When running 
- * against a set of of test scripts, our test harness calls 
- * myinit before starting each new script.
+//This function takes a spare sample record, mapping a new batch if there are none.
+sample *take_sample_record(void) {
+    if (spare_samples == NULL) {
+        sample *batch = mmap(NULL, SAMPLE_BATCH, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (batch == MAP_FAILED) return NULL;
+        for (size_t i = 0; i < SAMPLE_BATCH / sizeof(sample); i++) {
+            batch[i].nxt = spare_samples;
+            spare_samples = &batch[i];
+        }
+    }
+    sample *smp = spare_samples;
+    spare_samples = smp->nxt;
+    return smp;
+}
+
+//This function takes smp off the live list and keeps the record for reuse.
+void drop_sample(sample *smp) {
+    pthread_mutex_lock(&profile_lock);
+    if (smp->prev == NULL) {
+        live_samples = smp->nxt;
+    } else smp->prev->nxt = smp->nxt;
+    if (smp->nxt != NULL) smp->nxt->prev = smp->prev;
+    smp->nxt = spare_samples;
+    spare_samples = smp;
+    pthread_mutex_unlock(&profile_lock);
+}
+
+//This function returns the last word of a sampled block, where its sample is kept.
+sample **sample_slot(header *hdr) {
+    return (sample **)((char *)next_header(hdr) - sizeof(sample *));
+}
+
+//This function drops the sample of hdr as the block is freed or resized, with its arena's lock held.
+void forget_sample(header *hdr) {
+    drop_sample(*sample_slot(hdr));
+    hdr->size &= ~SAMPLED_BIT;
+}
+
+/* This function allocates a block for a request that is being sampled.
+ * It records the call stack from caller (the return address of
+ * mymalloc) outwards and hands out an ordinary block, even for a small
+ * request, with one extra word at its end for the sample. Returns NULL
+ * if no sample was taken, and the caller allocates as usual.
  */
-bool myinit(void *heap_start, size_t heap_size) {
-    //check if heap_size is at least 24 bytes (header + two pointers)
-    if (heap_size < (HEADER_SIZE + sizeof(listnode))) return false;
+void *malloc_sampled(tcache *tc, size_t requested_size, void *caller) {
+    next_sample(tc);
+    if (tc->in_profiler || __atomic_load_n(&profile_rate, __ATOMIC_RELAXED) == 0) return NULL;
+    void *frames[PROFILE_FRAMES + 8];
+    tc->in_profiler = true; //backtrace loads its unwinder, which allocates, on first use
+    int depth = backtrace(frames, PROFILE_FRAMES + 8);
+    tc->in_profiler = false;
+    int skip = 0;
+    while (skip < depth && frames[skip] != caller) skip++;
+    if (skip == depth) skip = 0;
 
-    segment_size = heap_size;
-    segment_start = heap_start;
-    
-    //initialize header
-    header *first = (header *)segment_start;
-    nbytes_inuse = 0; //initiate payload bytes in-use to 0
-    first->size = segment_size - HEADER_SIZE; //lsb = 0
-    num_header = 1;
+    pthread_mutex_lock(&profile_lock);
+    sample *smp = take_sample_record();
+    if (smp != NULL) {
+        smp->depth = depth - skip < PROFILE_FRAMES ? depth - skip : PROFILE_FRAMES;
+        memcpy(smp->frames, frames + skip, smp->depth * sizeof(void *));
+        smp->size = requested_size;
+        smp->prev = NULL;
+        smp->nxt = live_samples;
+        if (live_samples != NULL) live_samples->prev = smp;
+        live_samples = smp;
+    }
+    pthread_mutex_unlock(&profile_lock);
+    if (smp == NULL) return NULL;
 
-    nused = HEADER_SIZE + sizeof(listnode); //24 bytes
+    size_t needed = addpad(requested_size, ALIGNMENT) + sizeof(sample *);
+    void *ptr = requested_size >= MMAP_THRESHOLD ? map_block(needed, ALIGNMENT) : NULL;
+    arena *ar = tc->home;
+    pthread_mutex_lock(&ar->lock);
+    if (ptr == NULL) {
+        drain_remote(ar);
+        header *hdr = find_fit(ar, needed);
+        if (hdr == NULL && grow_arena(ar, needed)) hdr = find_fit(ar, needed);
+        if (hdr != NULL) ptr = alloc_block(ar, hdr, needed);
+    }
+    if (ptr != NULL) {
+        header *hdr = (header *)((char *)ptr - HEADER_SIZE);
+        hdr->size |= SAMPLED_BIT;
+        *sample_slot(hdr) = smp;
+        smp->block = ptr;
+    }
+    pthread_mutex_unlock(&ar->lock);
+    if (ptr == NULL) drop_sample(smp);
+    return ptr;
+}
 
-    //initialize linked list node with first free header
-    start = (listnode *)((char *)segment_start + HEADER_SIZE);
-    start->prev = NULL;
-    start->nxt = NULL;
+/* This function is myrealloc for a resize that is being sampled: the
+ * data moves to a new sampled block. Returns NULL if no sample was
+ * taken, and the caller resizes as usual.
+ */
+void *realloc_sampled(tcache *tc, void *old_ptr, size_t new_size, void *caller) {
+    void *ptr = malloc_sampled(tc, new_size, caller);
+    if (ptr == NULL) return NULL;
+    size_t old_size;
+    if (in_heap(old_ptr)) {
+        arena *ar = arena_of(old_ptr);
+        pthread_mutex_lock(&ar->lock);
+        old_size = in_slab(old_ptr) ? slab_of(old_ptr)->obj_size :
+                   get_size((header *)((char *)old_ptr - HEADER_SIZE));
+        pthread_mutex_unlock(&ar->lock);
+    } else old_size = get_size((header *)((char *)old_ptr - HEADER_SIZE));
+    memcpy(ptr, old_ptr, old_size < new_size ? old_size : new_size);
+    STAT(tc->counted.realloc_copied += old_size < new_size ? old_size : new_size);
+    myfree(old_ptr);
+    return ptr;
+}
 
-    //countline = 0; --for debugging purposes
-    
-    return true;
+/* This function is the fallback when the home arena is full: it tries
+ * every other arena in turn. Returns NULL if none has room.
+ */
+void *malloc_elsewhere(arena *home, size_t requested_size) {
+    for (int i = 0; i < num_arenas; i++) {
+        arena *ar = &arenas[i];
+        if (ar == home) continue;
+        pthread_mutex_lock(&ar->lock);
+        void *ptr = heap_malloc(ar, requested_size);
+        pthread_mutex_unlock(&ar->lock);
+        if (ptr != NULL) return ptr;
+    }
+    return NULL;
 }
 
-/* This function updates the linked list by adding the 
- * new node to its beginning.
+/* This function allocates memory for any thread. Requests of up to
+ * TCACHE_MAX_SIZE bytes are served from the thread's cache without
+ * locking; misses and larger requests go to the thread's home arena,
+ * then to the others if it is full.
+ * Returns NULL for a request of 0 or more than MAX_REQUEST_SIZE bytes,
+ * or when there is no more free space.
  */
-void add_to_beg(header *hdr) {
-    listnode *newfree = (listnode *)((char *)hdr + HEADER_SIZE);
-    if (start == NULL) { 
-        start = newfree;
-        start->prev = 0x0;
-        start->nxt = 0x0;
+void *mymalloc(size_t requested_size) {
+    if (requested_size <= 0 || requested_size > MAX_REQUEST_SIZE) {
+        STAT(tcache *tc = get_tcache(); count_call(tc, &tc->counted.mallocs, 0, true));
+        return NULL;
+    }
+    tcache *tc = get_tcache();
+    void *ptr;
+    if ((tc->until_sample -= (long)requested_size) < 0 &&
+        (ptr = malloc_sampled(tc, requested_size, __builtin_return_address(0))) != NULL) {
+        STAT(count_call(tc, &tc->counted.mallocs, requested_size, false));
+        return ptr;
+    }
+    if (requested_size <= TCACHE_MAX_SIZE) {
+        int idx = (requested_size + ALIGNMENT - 1) >> 3;
+        ptr = tc->heads[idx];
+        if (ptr != NULL) {
+            tc->heads[idx] = *(void **)ptr;
+            tc->count[idx]--;
+            STAT(count_call(tc, &tc->counted.mallocs, requested_size, false));
+            return ptr;
+        }
+        ptr = refill_tcache(tc, idx, requested_size);
     } else {
-        newfree->nxt = (char *)start - HEADER_SIZE;
-        newfree->prev = NULL;
-        start->prev = hdr;
-        start = newfree;
+        ptr = requested_size >= MMAP_THRESHOLD ? map_block(addpad(requested_size, ALIGNMENT), ALIGNMENT) : NULL;
+        if (ptr == NULL) { //a failed mapping falls back to the heap
+            pthread_mutex_lock(&tc->home->lock);
+            ptr = heap_malloc(tc->home, requested_size);
+            pthread_mutex_unlock(&tc->home->lock);
+        }
     }
+    if (ptr == NULL && num_arenas > 1) ptr = malloc_elsewhere(tc->home, requested_size);
+    STAT(count_call(tc, &tc->counted.mallocs, requested_size, ptr == NULL));
+    return ptr;
 }
 
-/* This function helps to remove the passed in node from
- * the freelist.
+/* This function allocates n blocks of size bytes for any thread and
+ * puts them in out, as n calls to mymalloc would. Requests the thread
+ * cache serves, and those that get mappings of their own, are exactly
+ * that; others take the home arena's lock once and carve_blocks cuts
+ * them from as few free blocks as it can. At most one block of a batch
+ * is sampled. Returns how many blocks it allocated, which is less
+ * than n only if the heap ran out of room.
  */
-void remove_node(listnode *ithnode) {
-    if (ithnode->prev == NULL && ithnode->nxt == NULL) { //only
-        start = NULL;
-    } else if (ithnode->prev == NULL) { //start
-        start = (listnode *)((char *)ithnode->nxt + HEADER_SIZE);
-        start->prev = NULL;
-    } else if (ithnode->nxt == NULL) { //end
-        listnode *second_last = (listnode *)((char *)ithnode->prev + HEADER_SIZE);
-        second_last->nxt = NULL;
-    } else { //middle
-        listnode *left = (listnode *)((char *)ithnode->prev + HEADER_SIZE);
-        listnode *right = (listnode *)((char *)ithnode->nxt + HEADER_SIZE);
-        left->nxt = ithnode->nxt;
-        right->prev = ithnode->prev;
+size_t mymalloc_batch(size_t size, size_t n, void *out[]) {
+    size_t done = 0;
+    if (size <= TCACHE_MAX_SIZE || size >= MMAP_THRESHOLD) {
+        while (done < n && (out[done] = mymalloc(size)) != NULL) done++;
+        return done;
+    }
+    tcache *tc = get_tcache();
+    if (n > 0 && (tc->until_sample -= (long)(size * n)) < 0 &&
+        (out[0] = malloc_sampled(tc, size, __builtin_return_address(0))) != NULL) {
+        done = 1;
     }
+    size_t needed = addpad(size, ALIGNMENT);
+    arena *ar = tc->home;
+    pthread_mutex_lock(&ar->lock);
+    drain_remote(ar);
+    size_t got = 1;
+    while (done < n && got > 0) {
+        got = carve_blocks(ar, needed, n - done, out + done);
+        done += got;
+    }
+    if (ar->ops >= ar->next_purge) purge_arena(ar);
+    pthread_mutex_unlock(&ar->lock);
+    while (done < n && num_arenas > 1 && (out[done] = malloc_elsewhere(ar, size)) != NULL) done++;
+    STAT(for (size_t i = 0; i < n; i++) count_call(tc, &tc->counted.mallocs, size, i >= done));
+    return done;
 }
 
-/* This function taken in a requested size and allocates memory
- * on the heap. Because it is an explicit implementation, it only
- * iterates through free nodes, and when the function finishes, a
- * pointer to a memory location is returned. If there are no more free
- * space, a NULL ptr is returned.
+/* This function clears the size bytes at ptr but for the range zero,
+ * which is known to read as zero already.
  */
-void *mymalloc(size_t requested_size) {
-    if (requested_size <= 0 || requested_size > MAX_REQUEST_SIZE) return NULL;
-    //align requested_size
-    size_t needed = addpad(requested_size, ALIGNMENT);
+void clear_dirty(char *ptr, size_t size, extent zero) {
+    char *end = ptr + size;
+    if (zero.from == NULL || zero.from >= end) {
+        memset(ptr, 0, size);
+        return;
+    }
+    memset(ptr, 0, zero.from - ptr);
+    if (zero.to < end) memset(zero.to, 0, end - zero.to);
+}
 
-    listnode *ithnode = start; //start from the beginning
-    
-    while (true) { //check if we reached end of linked list
-        header *curhdr = (header *)((char *)ithnode - HEADER_SIZE);
-        size_t prev_size = curhdr->size;
-        if (needed <= curhdr->size) {
-                
-            header *check_last = (header *)((char *)ithnode - HEADER_SIZE);
-            if ((char *)check_last + check_last->size + HEADER_SIZE == ((char *)segment_start + segment_size)) {
-                    
-                if (needed <= sizeof(listnode)) {
-                    curhdr->size = sizeof(listnode);
-                } else curhdr->size = needed;
-                nused += curhdr->size;
-                nbytes_inuse += curhdr->size;
-                
-                //attach new header at end
-                void *nxthdr = (char *)curhdr + curhdr->size + HEADER_SIZE;
-                header *new_hdr = (header *)nxthdr;
-                new_hdr->size = prev_size - HEADER_SIZE - curhdr->size;
-                num_header += 1;
-                nused += HEADER_SIZE;
-
-                //replace the old node (now taken) with a new node (the large free node)
-                remove_node(ithnode); 
-                add_to_beg(new_hdr); 
-                    
-            } else {
-                nbytes_inuse += curhdr->size; 
-                remove_node(ithnode);   
-            }          
-            curhdr->size |= 0x1;
-            break;
-        }
-        //else update ithnode
-        if (ithnode->nxt == NULL) return NULL;
-        ithnode = (listnode *)((char *)ithnode->nxt + HEADER_SIZE);
-    }
-    return (void *)ithnode; 
-}
-
-/* This function `coalesces` the two taken in headers.
- * Specifically, in this implementation, we delete the neighboring
- * node from the freelist if it is not adjacent to the header node.
- * If it is, we rewire the links.
- */
-void coalesce(header *hdr, header *neighbor) {
-    listnode *neinode = (listnode *)((char *)neighbor + HEADER_SIZE);
-
-    //check if hdrnode and neinode are adjacent
-    if ((neinode->nxt == NULL && neinode->prev == NULL) ||
-        (neinode->prev == hdr) || (neinode->nxt == hdr)) {
- 
-        if (neinode->nxt != NULL) { 
-            void *ptr_temp = neinode->nxt;
-            listnode *node_temp = (listnode *)((char *)ptr_temp + HEADER_SIZE);
-            node_temp->prev = hdr;
-        }
-       
-        listnode *hdrnode = (listnode *)((char *)hdr + HEADER_SIZE);
-        if (neinode == start) { 
-            listnode *start_temp = start;
-            start = hdrnode;
-            hdrnode->prev = NULL;
-            hdrnode->nxt = start_temp->nxt;
-        } else {
-            void *ptr_before = neinode->prev;
-            listnode *node_before = (listnode *)((char *)ptr_before + HEADER_SIZE);
-            if (node_before == hdrnode) { 
-                hdrnode->nxt = neinode->nxt;
-            } else { 
-                hdrnode->prev = neinode->prev; 
-                hdrnode->nxt = neinode->nxt;
-                node_before->nxt = (char *)hdrnode - HEADER_SIZE;
-            }
-        }
-        
-    } else remove_node(neinode);
+/* This function allocates count objects of size bytes, all zero, for
+ * any thread. Requests the thread cache may serve are plain mymalloc
+ * calls followed by a memset, and so are sampled blocks. Others only
+ * clear the bytes that may be dirty: a fresh mapping reads as
+ * zero, and so do the pages alloc_block reports in handed_zero (those
+ * of new chunks, those purging gave back, and those of a segment given
+ * to myinit_anonymous the heap never reached), which are neither
+ * written nor faulted in.
+ * Returns NULL if count * size overflows or is out of range for mymalloc.
+ */
+void *mycalloc(size_t count, size_t size) {
+    if (size != 0 && count > MAX_REQUEST_SIZE / size) {
+        STAT(tcache *tc = get_tcache(); count_call(tc, &tc->counted.mallocs, 0, true));
+        return NULL;
+    }
+    size_t total = count * size;
+    void *ptr;
+    if (total <= TCACHE_MAX_SIZE) {
+        ptr = mymalloc(total);
+        if (ptr != NULL) memset(ptr, 0, total);
+        return ptr;
+    }
+    tcache *tc = get_tcache();
+    if ((tc->until_sample -= (long)total) < 0 &&
+        (ptr = malloc_sampled(tc, total, __builtin_return_address(0))) != NULL) {
+        memset(ptr, 0, total);
+        STAT(count_call(tc, &tc->counted.mallocs, total, false));
+        return ptr;
+    }
+    ptr = total >= MMAP_THRESHOLD ? map_block(addpad(total, ALIGNMENT), ALIGNMENT) : NULL; //a fresh mapping is all zero
+    if (ptr == NULL) {
+        extent zero = {NULL, NULL};
+        pthread_mutex_lock(&tc->home->lock);
+        ptr = heap_malloc(tc->home, total);
+        if (ptr != NULL) zero = tc->home->handed_zero;
+        pthread_mutex_unlock(&tc->home->lock);
+        if (ptr == NULL && num_arenas > 1) ptr = malloc_elsewhere(tc->home, total);
+        if (ptr != NULL) clear_dirty(ptr, total, zero);
+    }
+    STAT(count_call(tc, &tc->counted.mallocs, total, ptr == NULL));
+    return ptr;
+}
+
+/* This function allocates an ordinary block of needed bytes whose
+ * payload lies on a multiple of align in arena ar, growing the arena
+ * if nothing fits. Returns NULL if it has no room.
+ */
+void *memalign_in(arena *ar, size_t needed, size_t align) {
+    pthread_mutex_lock(&ar->lock);
+    drain_remote(ar);
+    header *hdr = alloc_aligned(ar, needed, align, HEADER_SIZE);
+    if (hdr == NULL && grow_arena(ar, needed + align + 2 * MIN_BLOCK)) {
+        hdr = alloc_aligned(ar, needed, align, HEADER_SIZE);
+    }
+    if (hdr != NULL) {
+        ar->ops++;
+        count_small(ar, hdr, 1);
+    }
+    pthread_mutex_unlock(&ar->lock);
+    return hdr != NULL ? (char *)hdr + HEADER_SIZE : NULL;
 }
 
+/* This function allocates size bytes at a multiple of alignment, a
+ * power of two, for any thread. Alignments of up to ALIGNMENT are
+ * plain mymalloc calls. A request of MMAP_THRESHOLD bytes or more gets
+ * a mapping laid out so that its payload is aligned; any other is cut
+ * from a free block of the home arena (then of the others) by
+ * alloc_aligned, which gives the slack in front of it back to the
+ * freelists instead of wasting it. Either way the block is an ordinary
+ * one to myfree and myrealloc, though a realloc that moves it only
+ * keeps ALIGNMENT. Aligned blocks are never sampled by the profiler.
+ * Returns NULL if alignment is not a power of two or a request is out
+ * of range.
+ */
+void *mymemalign(size_t alignment, size_t size) {
+    if (alignment != 0 && alignment <= ALIGNMENT && (alignment & (alignment - 1)) == 0) return mymalloc(size);
+    tcache *tc = get_tcache();
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > MAX_REQUEST_SIZE ||
+        size == 0 || size > MAX_REQUEST_SIZE) {
+        STAT(count_call(tc, &tc->counted.mallocs, 0, true));
+        return NULL;
+    }
+    size_t needed = addpad(size, ALIGNMENT);
+    if (needed < MIN_PAYLOAD) needed = MIN_PAYLOAD;
+    void *ptr = size >= MMAP_THRESHOLD ? map_block(needed, alignment) : NULL;
+    if (ptr == NULL) ptr = memalign_in(tc->home, needed, alignment);
+    for (int i = 0; ptr == NULL && i < num_arenas; i++) {
+        if (&arenas[i] != tc->home) ptr = memalign_in(&arenas[i], needed, alignment);
+    }
+    STAT(count_call(tc, &tc->counted.mallocs, size, ptr == NULL));
+    return ptr;
+}
 
 /*
- *Takes care of freeing block at the pointer address.
- * Freed block should coalesce with its neighbor block to the right
- * if it is also free. If a null pointer is taken in, we simply return.
+ * Frees the block at ptr from any thread. A block owned by another
+ * arena than the thread's home is pushed onto that arena's remote list
+ * without taking a lock. Slab objects from the home arena go to the
+ * thread's cache unless their class is full, and ordinary blocks from
+ * it are freed and merged at once if its lock is free, or pushed onto
+ * its remote list like the others if another thread holds it. The
+ * slab bit of ptr's granule cannot change while ptr is allocated, so
+ * it is safe to test without a lock. A mapped block is unmapped
+ * straight away.
+ * If a null pointer is taken in, we simply return.
  */
 void myfree(void *ptr) {
     if (!ptr) return;
-    
-    //update header
-    header *hdr = (header *)((char *)ptr - HEADER_SIZE);
-    hdr->size ^= 0x1;
-    nbytes_inuse -= hdr->size;
-
-    header *neighbor = (header *)((char *)hdr + hdr->size + HEADER_SIZE);
-   
-    if (!(neighbor->size & 0x1)) { //coalesce
-        //update header (same as implicit)
-        hdr->size += HEADER_SIZE + neighbor->size;
-        num_header--; //we lose a header
-        
-        add_to_beg(hdr); 
-        coalesce(hdr, neighbor);
-        
-    } else add_to_beg(hdr); //without coalescing
-}
-
-//This function attaches a new header to the end of heap.
-void attach_header(header *curhdr, unsigned long prev_size) {
-    void *nxthdr = (char *)curhdr + curhdr->size + HEADER_SIZE;
-    header *new_hdr = (header *)nxthdr;
-    new_hdr->size = prev_size - HEADER_SIZE - curhdr->size;
-    num_header += 1;
-    nused += HEADER_SIZE;
-}
-
-//This function saves the first 16 bytes of payload data.
-void save_data(void *old_ptr, unsigned long pay1, unsigned long pay2) { 
-    *(unsigned long *)old_ptr = pay1;
-    char *temp = old_ptr;
-    temp += HEADER_SIZE;
-    *(unsigned long *)temp = pay2;
-}
-
-/* This function reallocates memory given a new size. It does
- * coalescing if neighboring right blocks are free. Then, it does
- * in-place realloc if size is big enough. If not, it calls
- * on mymalloc to move memory elsewhere.
+    tcache *tc = get_tcache();
+    STAT(count_call(tc, &tc->counted.frees, 0, false));
+    if (!in_heap(ptr)) {
+        unmap_block((header *)((char *)ptr - HEADER_SIZE));
+        return;
+    }
+    arena *ar = arena_of(ptr);
+    if (tc->home != ar) {
+        push_remote(ar, ptr, ptr);
+        return;
+    }
+    if (in_slab(ptr)) {
+        int idx = slab_of(ptr)->obj_size >> 3;
+        if (tc->count[idx] >= TCACHE_LIMIT) {
+            flush_tcache_class(tc, idx, ptr);
+            return;
+        }
+        *(void **)ptr = tc->heads[idx];
+        tc->heads[idx] = ptr;
+        tc->count[idx]++;
+        return;
+    }
+    if (pthread_mutex_trylock(&ar->lock) != 0) {
+        push_remote(ar, ptr, ptr);
+        return;
+    }
+    drain_remote(ar);
+    heap_free(ar, ptr);
+    pthread_mutex_unlock(&ar->lock);
+}
+
+static int compare_ptrs(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void *const *)a, y = (uintptr_t)*(void *const *)b;
+    return (x > y) - (x < y);
+}
+
+/* This function sorts the n pointers in ptrs by address. Batches are
+ * mostly short and often close to sorted already, as blocks allocated
+ * together tend to be freed together, so insertion sort does them
+ * without qsort's call per comparison.
+ */
+void sort_ptrs(void *ptrs[], size_t n) {
+    if (n > SORT_CUTOFF) {
+        qsort(ptrs, n, sizeof(void *), compare_ptrs);
+        return;
+    }
+    for (size_t i = 1; i < n; i++) {
+        void *ptr = ptrs[i];
+        size_t j = i;
+        for (; j > 0 && (uintptr_t)ptrs[j - 1] > (uintptr_t)ptr; j--) {
+            ptrs[j] = ptrs[j - 1];
+        }
+        ptrs[j] = ptr;
+    }
+}
+
+/* This function frees the n blocks in ptrs for any thread, as n calls
+ * to myfree would; null pointers are skipped. Slab objects and mapped
+ * blocks go to myfree. The rest are sorted by address, which uses ptrs
+ * as scratch space, and freed under one lock per arena, with blocks
+ * that lie back to back merged by free_run before they touch a
+ * freelist.
+ */
+void myfree_batch(void *ptrs[], size_t n) {
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        void *ptr = ptrs[i];
+        if (ptr == NULL) continue;
+        if (!in_heap(ptr) || in_slab(ptr)) {
+            myfree(ptr);
+        } else ptrs[m++] = ptr;
+    }
+    STAT(tcache *tc = get_tcache(); for (size_t i = 0; i < m; i++) count_call(tc, &tc->counted.frees, 0, false));
+    sort_ptrs(ptrs, m);
+    arena *ar = NULL;
+    for (size_t i = 0; i < m;) {
+        arena *owner = arena_of(ptrs[i]);
+        if (owner != ar) {
+            if (ar != NULL) pthread_mutex_unlock(&ar->lock);
+            ar = owner;
+            pthread_mutex_lock(&ar->lock);
+            drain_remote(ar);
+        }
+        size_t count = free_run(ar, ptrs + i, m - i);
+        i += count;
+        ar->ops += count;
+        if (ar->ops >= ar->next_purge) purge_arena(ar);
+    }
+    if (ar != NULL) pthread_mutex_unlock(&ar->lock);
+}
+
+/* This function reserves a block with room for size bytes of objects
+ * for myregion_alloc to cut up, for any thread. The block comes from
+ * mymalloc like any other, so a big region gets a mapping of its own.
+ * Returns NULL if size is 0 or there is no room.
+ */
+region *myregion_begin(size_t size) {
+    if (size == 0 || size > MAX_REQUEST_SIZE - sizeof(region)) return NULL;
+    region *r = mymalloc(sizeof(region) + size);
+    if (r == NULL) return NULL;
+    r->next = (char *)r + sizeof(region);
+    r->end = r->next + size;
+    return r;
+}
+
+/* This function hands out the next size bytes of region r, rounded up
+ * to ALIGNMENT, without a lock or a header. Returns NULL if size is 0
+ * or the region is full; the region is left as it was.
+ */
+void *myregion_alloc(region *r, size_t size) {
+    if (size == 0 || size > (size_t)(r->end - r->next)) return NULL;
+    char *ptr = r->next;
+    size_t taken = addpad(size, ALIGNMENT);
+    r->next = taken < (size_t)(r->end - ptr) ? ptr + taken : r->end; //the last object may take an unaligned tail
+    return ptr;
+}
+
+//This function returns a checkpoint of region r for myregion_reset.
+void *myregion_mark(region *r) {
+    return r->next;
+}
+
+/* This function frees every object of region r allocated after mark,
+ * or all of them if mark is NULL, by moving the bump pointer back; the
+ * block itself stays reserved. Returns false, and changes nothing, if
+ * mark is not a checkpoint of r that is still in use.
+ */
+bool myregion_reset(region *r, void *mark) {
+    char *to = mark != NULL ? mark : (char *)r + sizeof(region);
+    if (to < (char *)r + sizeof(region) || to > r->next) return false;
+    r->next = to;
+    return true;
+}
+
+/* This function frees region r and every object in it with one
+ * myfree of its block, which coalesces once however many objects
+ * there were.
+ */
+void myregion_release(region *r) {
+    myfree(r);
+}
+
+/* This function reallocates memory given a new size from any thread.
+ * A null old_ptr is a plain malloc and a new_size of 0 a plain free.
+ * The block is resized within the arena that owns it; only if that
+ * arena is full does it move to another one. A mapped block is
+ * resized by realloc_mapped without any arena lock.
  */
 void *myrealloc(void *old_ptr, size_t new_size) {
     if (!old_ptr) {
@@ -260,194 +2430,537 @@ void *myrealloc(void *old_ptr, size_t new_size) {
         myfree(old_ptr);
         return NULL;
     }
-    //if new_size is already smaller than current block, just return old ptr
-    header *curhdr = (header *)((char *)old_ptr - HEADER_SIZE);
-    if ((curhdr->size - 1) >= new_size) {
-        return old_ptr;
-    }
-    curhdr->size ^= 0x1; //turn lsb off
-    header *neighbor = (header *)((char *)curhdr + curhdr->size + HEADER_SIZE);
-    unsigned long pay1 = 0; //save first 16 bytes of payload data
-    unsigned long pay2 = 0;
-    pay1 = *((unsigned long *)(old_ptr));
-    pay2 = *((unsigned long *)((char *)old_ptr + HEADER_SIZE));
-    
-    bool coalesced = false;
-    int numit = 0;
-    while (true) { //if next node is free
-        if ((char *)neighbor == ((char *)segment_start + segment_size)) break;
-        if (!(neighbor->size & 0x1)) {
-            curhdr->size += HEADER_SIZE + neighbor->size; //update header
-            num_header--; //we lose a header
-            if (numit == 0) {
-                add_to_beg(curhdr);
-            }
-            coalesce(curhdr, neighbor);
-            coalesced = true;
-        } else break;
-        //update neighbor
-        neighbor = (header *)((char *)neighbor + neighbor->size + HEADER_SIZE);
-        numit++;
-    }
-    if (!coalesced) add_to_beg(curhdr);
-    curhdr->size ^= 0x1; //turn lsb back on
-
-    if ((curhdr->size - 1) < new_size) { //if new_size still larger, reallocate
-        void *moved_ptr = mymalloc(new_size); 
-        if (!moved_ptr) return NULL;
+    tcache *tc = get_tcache();
+    void *ptr;
+    if (new_size <= MAX_REQUEST_SIZE && (tc->until_sample -= (long)new_size) < 0 &&
+        (ptr = realloc_sampled(tc, old_ptr, new_size, __builtin_return_address(0))) != NULL) {
+        STAT(count_call(tc, &tc->counted.reallocs, new_size, false));
+        STAT(tc->counted.realloc_moved++);
+        return ptr;
+    }
+    if (!in_heap(old_ptr)) {
+        ptr = realloc_mapped(old_ptr, new_size);
+        STAT(count_call(tc, &tc->counted.reallocs, new_size, ptr == NULL));
+        STAT(if (ptr == old_ptr) tc->counted.realloc_in_place++;
+             else if (ptr != NULL) tc->counted.realloc_moved++);
+        STAT(if (ptr != NULL && in_heap(ptr)) tc->counted.realloc_copied += new_size); //shrunk back into the heap
+        return ptr;
+    }
+    arena *ar = arena_of(old_ptr);
+    pthread_mutex_lock(&ar->lock);
+    ptr = heap_realloc(ar, old_ptr, new_size);
+    size_t old_size = 0; //only needed if the block stayed where it was
+    if (ptr == NULL) {
+        old_size = in_slab(old_ptr) ? slab_of(old_ptr)->obj_size :
+                   get_size((header *)((char *)old_ptr - HEADER_SIZE));
+    }
+    pthread_mutex_unlock(&ar->lock);
+    if (ptr == NULL && num_arenas > 1 && new_size <= MAX_REQUEST_SIZE) {
+        ptr = malloc_elsewhere(ar, new_size);
+        if (ptr != NULL) {
+            memcpy(ptr, old_ptr, old_size);
+            myfree(old_ptr);
+            STAT(tc->counted.realloc_moved++);
+            STAT(tc->counted.realloc_copied += old_size);
+        }
+    }
+    STAT(count_call(tc, &tc->counted.reallocs, new_size, ptr == NULL));
+    return ptr;
+}
 
-        unsigned long old_prev = *(unsigned long *)old_ptr; //save prev and nxt addresses
-        unsigned long old_nxt = *(unsigned long *)((char *)old_ptr + HEADER_SIZE);
-        
-        //put user data back
-        save_data(old_ptr, pay1, pay2);
-        memcpy(moved_ptr, old_ptr, new_size);
-
-        *(unsigned long *)old_ptr = old_prev; //put prev and nxt addresses back
-        old_ptr = (char *)old_ptr + HEADER_SIZE;
-        *(unsigned long *)old_ptr = old_nxt;
-        
-        curhdr->size ^= 0x1; //mark the pointer as freed
-        return moved_ptr;
-    } else { //in-place realloc and return block of proper size by splitting
-        unsigned long align_size = addpad(new_size, ALIGNMENT);
-        unsigned long prev_size = curhdr->size - 1;
-        if ((prev_size - align_size) <= sizeof(listnode)) {
-            //remove node from freelist
-            listnode *old_node = (listnode *)((char *)curhdr + HEADER_SIZE);
-            remove_node(old_node);
-            
-            //put data back
-            *(unsigned long *)old_ptr = pay1;
-            char *temp = old_ptr;
-            temp += HEADER_SIZE;
-            *(unsigned long *)temp = pay2;
-            return old_ptr;
+/* This function sums the counters of every arena and thread; the peak
+ * bytes in use are of the whole heap rather than a sum. The calling
+ * thread's own counts are added in first, so a single-threaded client
+ * sees exact numbers; other threads' may trail by up to STATS_FOLD
+ * calls each.
+ */
+bool mystats(heap_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    STAT(if (num_arenas > 0) fold_thread_stats(get_tcache()));
+    for (int i = 0; i < num_arenas; i++) {
+        arena *ar = &arenas[i];
+        pthread_mutex_lock(&ar->lock);
+        stats->bytes_in_use += ar->nbytes_inuse;
+        //an arena's reach and its chunks never shrink before myinit, so their sum is the heap's peak
+        stats->peak_footprint += ar->nused + ar->num_chunks * CHUNK_SIZE;
+        stats->num_blocks += ar->num_header;
+        add_counts(stats, &ar->stats);
+        pthread_mutex_unlock(&ar->lock);
+    }
+    pthread_mutex_lock(&mapping_lock);
+    stats->mapped_bytes = mapped_bytes;
+    stats->num_mapped = num_mappings;
+    pthread_mutex_unlock(&mapping_lock);
+    pthread_mutex_lock(&stats_lock);
+    add_counts(stats, &thread_totals);
+    pthread_mutex_unlock(&stats_lock);
+    STAT(stats->peak_bytes_in_use = __atomic_load_n(&heap_peak_in_use, __ATOMIC_RELAXED));
+    return STATS_ENABLED;
+}
+
+/* This function starts the profiler sampling about once every rate
+ * bytes allocated, or stops it if rate is 0. Other threads notice at
+ * their next sample, or within PROFILE_IDLE_CHECK bytes if it was off.
+ */
+bool myprofile(size_t rate) {
+    __atomic_store_n(&profile_rate, rate, __ATOMIC_RELAXED);
+    next_sample(&cache);
+    return true;
+}
+
+static int compare_stacks(const void *a, const void *b) {
+    const sample *x = a, *y = b;
+    if (x->depth != y->depth) return x->depth - y->depth;
+    return memcmp(x->frames, y->frames, x->depth * sizeof(void *));
+}
+
+//This function writes all len bytes of buf to fd.
+bool write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* This function writes the live samples to path as a heap profile in
+ * the text format pprof reads ("heap_v2"): one line per distinct call
+ * stack with its sampled block count and bytes, then the memory map
+ * pprof needs to find the symbols. pprof scales the samples up using
+ * the rate in the first line. The samples are copied out under the lock
+ * and everything after that runs without it; calls this makes to
+ * mymalloc (from qsort) are never sampled.
+ */
+bool myprofile_dump(const char *path) {
+    cache.in_profiler = true;
+    for (int i = 0; i < num_arenas; i++) { //blocks waiting on a remote list are already freed
+        pthread_mutex_lock(&arenas[i].lock);
+        drain_remote(&arenas[i]);
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    pthread_mutex_lock(&profile_lock);
+    size_t count = 0;
+    for (sample *smp = live_samples; smp != NULL; smp = smp->nxt) {
+        count++;
+    }
+    size_t bytes = (count + 1) * sizeof(sample);
+    sample *copy = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (copy != MAP_FAILED) {
+        count = 0;
+        for (sample *smp = live_samples; smp != NULL; smp = smp->nxt) {
+            copy[count++] = *smp;
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+    int fd = copy != MAP_FAILED ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (fd < 0) {
+        if (copy != MAP_FAILED) munmap(copy, bytes);
+        cache.in_profiler = false;
+        return false;
+    }
+    qsort(copy, count, sizeof(sample), compare_stacks);
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += copy[i].size;
+    }
+    char line[64 + PROFILE_FRAMES * 20];
+    int len = snprintf(line, sizeof(line), "heap profile: %zu: %zu [0: 0] @ heap_v2/%zu\n", count, total,
+                       __atomic_load_n(&profile_rate, __ATOMIC_RELAXED));
+    bool ok = write_all(fd, line, len);
+    for (size_t i = 0, j; ok && i < count; i = j) {
+        size_t stack_bytes = 0;
+        for (j = i; j < count && compare_stacks(&copy[i], &copy[j]) == 0; j++) {
+            stack_bytes += copy[j].size;
+        }
+        len = snprintf(line, sizeof(line), "%zu: %zu [0: 0] @", j - i, stack_bytes);
+        for (int f = 0; f < copy[i].depth; f++) {
+            len += snprintf(line + len, sizeof(line) - len, " %p", copy[i].frames[f]);
         }
-        //if what's left is nonzero, update header and add free block to beg. of list
-        curhdr->size = align_size; //lsb currently off
-        
-        //attach new free header at end
-        void *nxthdr = (char *)curhdr + curhdr->size + HEADER_SIZE;
-        header *new_hdr = (header *)nxthdr;
-        new_hdr->size = prev_size - HEADER_SIZE - curhdr->size;
-        num_header += 1;
-        nused += HEADER_SIZE;
-        curhdr->size ^= 0x1; //turn lsb back on
-        
-        //move info from first part to second part (the splitted block)
-        listnode *oldnode = (listnode *)((char *)curhdr + HEADER_SIZE);
-        remove_node(oldnode); //remove the coalesced node from freelist
-        add_to_beg(new_hdr); //add splitted node to freelist
-        
-        //put data back
-        *(unsigned long *)old_ptr = pay1;
-        char *temp = old_ptr;
-        temp += HEADER_SIZE;
-        *(unsigned long *)temp = pay2;
-        
-        return old_ptr;
+        line[len++] = '\n';
+        ok = write_all(fd, line, len);
+    }
+    ok = ok && write_all(fd, "\nMAPPED_LIBRARIES:\n", strlen("\nMAPPED_LIBRARIES:\n"));
+    int maps = open("/proc/self/maps", O_RDONLY);
+    ssize_t n;
+    while (ok && maps >= 0 && (n = read(maps, line, sizeof(line))) > 0) {
+        ok = write_all(fd, line, n);
+    }
+    if (maps >= 0) close(maps);
+    if (close(fd) != 0) ok = false;
+    munmap(copy, bytes);
+    cache.in_profiler = false;
+    return ok;
+}
+
+/* This function checks that a slab block is granule-sized and aligned
+ * and that its free count agrees with its bitmap.
+ */
+bool check_slab(header *hdr) {
+    slab *s = (slab *)((char *)hdr + HEADER_SIZE);
+    unsigned int nfree = 0;
+    for (int w = 0; w < SLAB_MAP_WORDS; w++) {
+        nfree += __builtin_popcountl(s->free_map[w]);
+    }
+    if (((uintptr_t)hdr & (SLAB_SIZE - 1)) || get_size(hdr) != SLAB_SIZE - HEADER_SIZE ||
+        s->obj_size > SLAB_MAX_SIZE || slab_sizes[slab_class[s->obj_size >> 3]] != s->obj_size ||
+        nfree != s->nfree) {
+        printf("Oops! Slab %p is corrupted.\n", s);
+        breakpoint();
+        return false;
     }
+    return true;
 }
 
 /* 
- * Return true if all is ok, or false otherwise.
+ * Return true if all is ok, or false otherwise. Blocks sitting in
+ * thread caches count as allocated.
  * This function is called periodically by the test
  * harness to check the state of the heap allocator.
+ * Besides walking the blocks, it checks the footers and
+ * prev-free bits, that every size class only holds free
+ * blocks of its own size range and that bin_map agrees with
+ * which classes are non-empty. Mapped blocks are checked apart.
  */
 bool validate_heap() {
-    int num_free_hdr = 0;
-    header *cur = (header *)segment_start;
-    for (int i = 0; i < num_header; i++) {
-        if (!(cur->size & 0x1)) {
-            num_free_hdr++;
-        }
-        void *temp; 
-        if (cur->size & 0x1) { //used
-            temp = (char *)cur + HEADER_SIZE - 1 + cur->size;
-        } else { //if not used
-            temp = (char *)cur + HEADER_SIZE + cur->size;
+    for (int i = 0; i < num_arenas; i++) {
+        arena *ar = &arenas[i];
+        pthread_mutex_lock(&ar->lock);
+        drain_remote(ar);
+        bool ok = check_heap(ar);
+        pthread_mutex_unlock(&ar->lock);
+        if (!ok) return false;
+    }
+    pthread_mutex_lock(&mapping_lock);
+    bool ok = check_mappings();
+    pthread_mutex_unlock(&mapping_lock);
+    return ok;
+}
+
+/* This function checks the list of mapped blocks, with mapping_lock
+ * held: links, flags, that each payload fills its mapping and that
+ * the totals agree.
+ */
+bool check_mappings(void) {
+    size_t bytes = 0;
+    int count = 0;
+    mapping *prev = NULL;
+    for (mapping *m = mappings; m != NULL; m = m->nxt) {
+        header *hdr = mapping_header(m);
+        if (m->prev != prev || in_heap(m) || (hdr->size & (MAPPED_BIT | USED_BIT)) != (MAPPED_BIT | USED_BIT) ||
+            (hdr->size & (PREV_FREE | PREV_MIN)) ||
+            get_size(hdr) != (size_t)(mapping_base(m) + m->length - ((char *)hdr + HEADER_SIZE))) {
+            printf("Oops! Mapped block %p is corrupted.\n", hdr);
+            breakpoint();
+            return false;
         }
-        cur = (header *)temp;
+        bytes += get_size(hdr);
+        count++;
+        prev = m;
+    }
+    if (bytes != mapped_bytes || count != num_mappings) {
+        printf("Oops! Mapped blocks add up to %zu bytes in %d, not %zu in %d.\n", bytes, count,
+               mapped_bytes, num_mappings);
+        breakpoint();
+        return false;
     }
+    return true;
+}
 
-    listnode *node = start;
-    int cnt = 0;
-    while (node != NULL) {
-        cnt++;
-        if (node->nxt != NULL) {
-            node = (listnode *)((char *)node->nxt + HEADER_SIZE);
-        } else break;
+/* This function tells whether the word at ptr, in pages said to be
+ * zero, reads as zero. A page that is not resident is not read, since
+ * that would fault a purged page back in and undo the purge; a purged
+ * page of private anonymous memory comes back zero anyway.
+ */
+bool reads_zero(unsigned long *ptr) {
+    unsigned char resident;
+    if (mincore((void *)((uintptr_t)ptr & ~(page_size - 1)), page_size, &resident) == 0 && !(resident & 1)) {
+        return true;
     }
+    return *ptr == 0;
+}
 
-    if (cnt != num_free_hdr) {
-        printf("Number of free headers does not match number of free list nodes\n");
+/* This function checks the subtree at node for check_heap: parent
+ * links, sizes, the order (last is the node before it) and the
+ * red-black rules. Returns its black height, or -1 if something is
+ * wrong. count adds up the nodes.
+ */
+int check_tree(treenode *node, treenode *parent, treenode **last, int *count) {
+    if (node == NULL) return 1;
+    int left = check_tree(node->left, node, last, count);
+    if (left < 0) return -1;
+    header *hdr = tree_header(node);
+    if (node->parent != parent || is_used(hdr) || get_size(hdr) <= TREE_MIN_SIZE ||
+        (*last != NULL && !tree_less(*last, node))) {
+        printf("Oops! Tree node %p is misplaced.\n", node);
+        breakpoint();
+        return -1;
+    }
+    if (node->red && (is_red(node->left) || is_red(node->right))) {
+        printf("Oops! Red tree node %p has a red child.\n", node);
+        breakpoint();
+        return -1;
+    }
+    extent room = purgeable(hdr);
+    extent clean = node->pages.clean;
+    if (clean.from != NULL && (clean.from < room.from || clean.to > room.to || clean.from >= clean.to ||
+        ((uintptr_t)clean.from & (page_size - 1)) || !reads_zero((unsigned long *)clean.from) ||
+        !reads_zero((unsigned long *)clean.to - 1))) {
+        printf("Oops! Pages of tree node %p said to be zero are not.\n", node);
+        breakpoint();
+        return -1;
+    }
+    *last = node;
+    (*count)++;
+    int right = check_tree(node->right, node, last, count);
+    if (right < 0) return -1;
+    if (left != right) {
+        printf("Oops! Subtrees of tree node %p differ in black height.\n", node);
+        breakpoint();
+        return -1;
+    }
+    return left + !node->red;
+}
+
+//This function checks the fence that ends a chunk, and its prev-free bits.
+bool check_fence(header *fence, bool prev_free, bool prev_min) {
+    if (fence->size != (USED_BIT | (prev_free ? PREV_FREE : 0) | (prev_min ? PREV_MIN : 0))) {
+        printf("Oops! Fence %p of a chunk is corrupted.\n", fence);
         breakpoint();
         return false;
     }
+    return true;
+}
 
-    cur = (header *)segment_start;
+/* This function does the work of validate_heap for one arena, with
+ * its lock held.
+ */
+bool check_heap(arena *ar) {
+    int num_free_hdr = 0;
     size_t segment_bytes = 0;
-    for (int i = 0; i < num_header; i++) {
-        segment_bytes += HEADER_SIZE;
-        void *temp;
-        if (cur->size & 0x1) { //used
-            temp = (char *)cur + HEADER_SIZE - 1 + cur->size;
-            segment_bytes += cur->size - 1;
-        } else { //if not used, free
-            temp = (char *)cur + HEADER_SIZE + cur->size;
-            segment_bytes += cur->size;
-        }
-        cur = (header *)temp;
-    }
-    //size - check if all segment_size is accounted for
-    if (segment_bytes != segment_size) {
+    size_t validate_payload = 0;
+    bool prev_free = false;
+    bool prev_min = false;
+    int num_partial = 0;
+    int num_small = 0;
+    header *cur = (header *)ar->start;
+    void *seg_end = ar->end;
+    chunk *next_chunk = ar->chunks;
+    for (int i = 0; i < ar->num_header; i++) {
+        if ((void *)cur == seg_end && next_chunk != NULL) { //on to the blocks of the next chunk
+            if (seg_end != ar->end && !check_fence((header *)seg_end, prev_free, prev_min)) return false;
+            cur = chunk_first(next_chunk);
+            seg_end = chunk_fence(next_chunk);
+            next_chunk = next_chunk->nxt;
+            prev_free = prev_min = false;
+        }
+        if ((void *)cur >= seg_end) {
+            printf("Oops! Address is not within heap bounds.\n");
+            breakpoint();
+            return false;
+        }
+        if (prev_free != ((cur->size & PREV_FREE) != 0) ||
+            prev_min != ((cur->size & PREV_MIN) != 0)) {
+            printf("Oops! Prev-free bit of header %p is wrong.\n", cur);
+            breakpoint();
+            return false;
+        }
+        segment_bytes += HEADER_SIZE + get_size(cur);
+        if (is_used(cur)) {
+            validate_payload += get_size(cur);
+            if ((cur->size & SAMPLED_BIT) && (*sample_slot(cur))->block != (char *)cur + HEADER_SIZE) {
+                printf("Oops! Sampled block %p does not point to its sample.\n", cur);
+                breakpoint();
+                return false;
+            }
+            if (in_slab((char *)cur + HEADER_SIZE)) {
+                if (!check_slab(cur)) return false;
+                if (((slab *)((char *)cur + HEADER_SIZE))->nfree > 0) num_partial++;
+            } else if (get_size(cur) <= SLAB_MAX_SIZE) num_small++;
+        } else {
+            if (prev_free) {
+                printf("Oops! Two free blocks next to each other at %p.\n", cur);
+                breakpoint();
+                return false;
+            }
+            if (cur->size & SAMPLED_BIT) {
+                printf("Oops! Free block %p is still marked sampled.\n", cur);
+                breakpoint();
+                return false;
+            }
+            if (get_size(cur) > MIN_PAYLOAD &&
+                *(unsigned long *)((char *)next_header(cur) - FOOTER_SIZE) != get_size(cur)) {
+                printf("Oops! Footer of free block %p does not match its header.\n", cur);
+                breakpoint();
+                return false;
+            }
+            num_free_hdr++;
+        }
+        prev_free = !is_used(cur);
+        prev_min = prev_free && get_size(cur) == MIN_PAYLOAD;
+        cur = next_header(cur);
+    }
+    //size - check if all segment_size and every chunk is accounted for
+    size_t chunk_bytes = CHUNK_SIZE - sizeof(chunk) - HEADER_SIZE;
+    if (segment_bytes != ar->size + ar->num_chunks * chunk_bytes || (void *)cur != seg_end ||
+        next_chunk != NULL) {
         printf("Oops! Not all of the segment size is accounted for.\n");
         breakpoint();
         return false;
     }
+    if (seg_end != ar->end && !check_fence((header *)seg_end, prev_free, prev_min)) return false;
+    if (validate_payload != ar->nbytes_inuse) {
+        printf("Oops! Total payload bytes currently in use does not match sum of in-use block sizes.\n");
+        breakpoint();
+        return false;
+    }
+    if (num_small != ar->small_live) {
+        printf("Oops! small_live does not match the number of small blocks in use.\n");
+        breakpoint();
+        return false;
+    }
+    for (int cls = 0; cls < NUM_SLAB_CLASSES; cls++) {
+        slab *prev = NULL;
+        for (slab *sl = ar->partial[cls]; sl != NULL; sl = sl->nxt) {
+            if (sl->nfree == 0 || sl->obj_size != slab_sizes[cls] || sl->prev != prev) {
+                printf("Oops! Slab %p is misplaced in partial list %d\n", sl, cls);
+                breakpoint();
+                return false;
+            }
+            prev = sl;
+            num_partial--;
+        }
+    }
+    if (num_partial != 0) {
+        printf("Oops! Partial slab lists do not match the slabs with free slots.\n");
+        breakpoint();
+        return false;
+    }
+
+    int cnt = 0;
+    treenode *last = NULL;
+    if (is_red(ar->tree_root) || check_tree(ar->tree_root, NULL, &last, &cnt) < 0) {
+        printf("Oops! The tree of large free blocks is broken.\n");
+        breakpoint();
+        return false;
+    }
+    int queued = 0;
+    for (treenode *node = ar->decay_oldest; node != NULL; node = node->newer) {
+        if (!node->queued || node->older != (queued == 0 ? NULL : last) || ++queued > cnt ||
+            is_used(tree_header(node)) || get_size(tree_header(node)) <= TREE_MIN_SIZE) {
+            printf("Oops! Decay list node %p is not a queued tree block.\n", node);
+            breakpoint();
+            return false;
+        }
+        last = node;
+    }
+    if (ar->decay_newest != (queued > 0 ? last : NULL)) {
+        printf("Oops! The decay list does not end at its newest block.\n");
+        breakpoint();
+        return false;
+    }
+    for (int bin = 0; bin < NUM_BINS; bin++) {
+        bool nonempty = bin == TREE_BIN ? ar->tree_root != NULL : ar->bins[bin] != NULL;
+        if (nonempty != ((ar->bin_map >> bin) & 1)) {
+            printf("Oops! bin_map does not match size class %d\n", bin);
+            breakpoint();
+            return false;
+        }
+        listnode *prev = NULL;
+#ifdef NEXT_FIT
+        bool rover_seen = false;
+#endif
+        for (listnode *node = ar->bins[bin]; node != NULL; node = node_next(node)) {
+            header *hdr = node_to_header(node);
+            if (is_used(hdr) || find_bin(get_size(hdr)) != bin || node_prev(node) != prev) {
+                printf("Oops! Free list node %p is misplaced in size class %d\n", node, bin);
+                breakpoint();
+                return false;
+            }
+#ifdef NEXT_FIT
+            if (node == ar->rovers[bin]) rover_seen = true;
+#endif
+            prev = node;
+            cnt++;
+        }
+#ifdef NEXT_FIT
+        if (ar->rovers[bin] != NULL && !rover_seen) {
+            printf("Oops! Rover of size class %d is not on its list\n", bin);
+            breakpoint();
+            return false;
+        }
+#endif
+    }
+    if (cnt != num_free_hdr) {
+        printf("Number of free headers does not match number of free list nodes\n");
+        breakpoint();
+        return false;
+    }
     
     return true;
 }
 
 /* Used to dump the heap and its contents. Also 
- * Prints out header information and the freelist.
+ * Prints out header information and the freelists.
  */
 void dump_heap() {
+    for (int i = 0; i < num_arenas; i++) {
+        printf("Arena %d\n", i);
+        dump_arena(&arenas[i]);
+    }
+    for (mapping *m = mappings; m != NULL; m = m->nxt) {
+        printf("Mapped block %p: %lu\n", mapping_header(m), mapping_header(m)->size);
+    }
+}
+
+//This function prints the tree in order, indented by depth.
+void dump_tree(treenode *node, int depth) {
+    if (node == NULL) return;
+    dump_tree(node->left, depth + 1);
+    printf("%*sTree node (%p): %lu %s\n", 2 * depth, "", node, get_size(tree_header(node)),
+           node->red ? "red" : "black");
+    dump_tree(node->right, depth + 1);
+}
+
+//This function dumps one arena for dump_heap.
+void dump_arena(arena *ar) {
      printf("Heap segment starts at address %p, ends at %p. %lu bytes currently used.",
-            segment_start, (char *)segment_start + segment_size, nused);
+            ar->start, ar->end, ar->nused);
 
      //nused = 0; //custom for testing
-     for (int i = 0; i < nused; i++) {
-          unsigned char *cur = (unsigned char *)segment_start + i;
+     for (int i = 0; i < ar->nused; i++) {
+          unsigned char *cur = (unsigned char *)ar->start + i;
           if (i % 32 == 0) {
               printf("\n%p: ", cur);
           }
           printf("%02x ", *cur);
     }
     printf("\n\n");
-    header *cur = (header *)segment_start;
-    for (int i = 0; i < num_header; i++) {
-        printf("Header %d (%p): %lu\n", i, cur, cur->size);
-        //printf("Ptrs: (%p)\n", (listnode *)((char *)cur + HEADER_SIZE));
-        void *temp; //extract the following into helper function!
-        if (cur->size & 0x1) { //used
-            temp = (char *)cur + HEADER_SIZE - 1 + cur->size;
-        } else { //if not used
-            temp = (char *)cur + HEADER_SIZE + cur->size;
+    header *cur = (header *)ar->start;
+    chunk *next_chunk = ar->chunks;
+    for (int i = 0; i < ar->num_header; i++) {
+        if (((void *)cur == ar->end || get_size(cur) == 0) && next_chunk != NULL) { //at a fence
+            printf("Chunk %p\n", next_chunk);
+            cur = chunk_first(next_chunk);
+            next_chunk = next_chunk->nxt;
         }
-        cur = (header *)temp;
+        printf("Header %d (%p): %lu\n", i, cur, cur->size);
+        cur = next_header(cur);
     }
     printf("\n");
-    listnode *node = start;
-    int cnt = 0;
-    while (node != NULL) {
-        printf("%d Free list node (%p): %p %p\n", cnt, node, node->prev, node->nxt);
-        cnt++;
-        if (node->nxt != NULL) {
-            node = (listnode *)((char *)node->nxt + HEADER_SIZE);
-        } else break;
+    for (int bin = 0; bin < NUM_BINS; bin++) {
+        int cnt = 0;
+        for (listnode *node = ar->bins[bin]; node != NULL; node = node_next(node)) {
+            printf("Class %d, %d Free list node (%p): %p %p\n", bin, cnt, node, node_prev(node), node_next(node));
+            cnt++;
+        }
+    }
+    dump_tree(ar->tree_root, 0);
+    for (int cls = 0; cls < NUM_SLAB_CLASSES; cls++) {
+        for (slab *s = ar->partial[cls]; s != NULL; s = s->nxt) {
+            printf("Slab of %u-byte objects (%p): %u free\n", s->obj_size, s, s->nfree);
+        }
     }
 }
-
-
@@ -3,18 +3,46 @@
  * File: implicit.c
  * This program implements a implicit heap manager using
  * in-place reallocation and first-fit search.
+ * A free block is merged with the free blocks next to it. By default
+ * this happens in myfree: a free block ends in a footer holding its
+ * size, and a header flag says whether the block before it is free, so
+ * both neighbors are found without a walk. Built with DEFERRED_COALESCE,
+ * myfree only clears the used bit, and mymalloc merges every run of
+ * free blocks in one sweep when the first-fit scan finds nothing short
+ * of the end of the heap.
+ * The placement policy is chosen at compile time as well: first fit by
+ * default, -DNEXT_FIT to start each scan where the last one stopped,
+ * -DBEST_FIT for the smallest block that fits, or -DGOOD_FIT=K for the
+ * smallest of the first K blocks that fit.
  */
 #include "allocator.h"
 #include "debug_break.h"
+#include "stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
 
 #define HEADER_SIZE 8 //bytes
+#define FOOTER_SIZE 8 //copy of a free block's size in its last word (immediate coalescing only)
+#define USED 0x1
+#define PREV_FREE 0x2 //the block before this one is free (immediate coalescing only)
+#define FLAG_BITS 0x7
+#define MIN_BLOCK (HEADER_SIZE + ALIGNMENT) //smallest block a split may leave, room for a footer
+
+#if defined(BEST_FIT)
+#define FIT_CANDIDATES INT_MAX
+#elif defined(GOOD_FIT)
+#define FIT_CANDIDATES GOOD_FIT //blocks that fit to compare before taking the smallest
+#else
+#define FIT_CANDIDATES 1 //first fit
+#endif
 
 typedef struct {
-    unsigned long size; //used for casting header size
+    unsigned long size; //payload bytes, with the flags above in the low bits
 } header;
 
 static size_t segment_size;
@@ -22,6 +50,17 @@ static size_t nused;
 static size_t nbytes_inuse;
 static void *segment_start;
 static int num_header;
+static heap_stats stats; //counters of mystats (HEAP_STATS only)
+#ifdef DEFERRED_COALESCE
+static bool unmerged; //a block was freed since the last sweep
+#endif
+#ifdef NEXT_FIT
+static header *rover; //where the next search starts
+#endif
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER; //guards everything above
+
+bool check_heap(void);
 
 /*
  * This function rounds up the size requested to the given multiple (must b * e a power of 2) and returns the result.
@@ -30,6 +69,163 @@ size_t addpad(size_t size, size_t mult) {
     return (size + mult - 1) & ~(mult - 1);
 }
 
+size_t get_size(header *hdr) {
+    return hdr->size & ~(unsigned long)FLAG_BITS;
+}
+
+bool is_used(header *hdr) {
+    return hdr->size & USED;
+}
+
+header *next_header(header *hdr) {
+    return (header *)((char *)hdr + HEADER_SIZE + get_size(hdr));
+}
+
+bool is_last(header *hdr) {
+    return (char *)next_header(hdr) >= (char *)segment_start + segment_size;
+}
+
+//This function keeps the rover off a header that was just merged into the block before it.
+void note_merge(header *into, header *gone) {
+#ifdef NEXT_FIT
+    if (rover == gone) rover = into;
+#endif
+}
+
+/* This function marks hdr as allocated. With immediate coalescing it also
+ * clears the flag in the next header that says hdr is free.
+ */
+void set_used(header *hdr) {
+    hdr->size |= USED;
+#ifndef DEFERRED_COALESCE
+    if (!is_last(hdr)) next_header(hdr)->size &= ~(unsigned long)PREV_FREE;
+#endif
+}
+
+/* This function marks hdr as free. With immediate coalescing it also
+ * writes the footer and sets the flag in the next header, which is how
+ * the next block finds hdr when it is freed.
+ */
+void set_free(header *hdr) {
+    hdr->size &= ~(unsigned long)USED;
+#ifndef DEFERRED_COALESCE
+    *(unsigned long *)((char *)next_header(hdr) - FOOTER_SIZE) = get_size(hdr);
+    if (!is_last(hdr)) next_header(hdr)->size |= PREV_FREE;
+#endif
+}
+
+/* This function splits hdr so that it keeps needed bytes of payload, if
+ * what is left over can hold a block of its own. The rest becomes a free
+ * block. When a block is handed out, the block after it is never free, so
+ * the rest has nothing to merge with in immediate mode; shrink_block
+ * merges it when the block was already in use.
+ */
+void split_block(header *hdr, size_t needed) {
+    size_t size = get_size(hdr);
+    if (size - needed < MIN_BLOCK) return;
+    hdr->size -= size - needed; //flags stay
+    header *rest = next_header(hdr);
+    rest->size = size - needed - HEADER_SIZE;
+    set_free(rest);
+    num_header += 1;
+    STAT(stats.splits++);
+}
+
+#ifndef DEFERRED_COALESCE
+//This function uses the footer of the free block before hdr to find its header.
+header *prev_header(header *hdr) {
+    size_t prev_size = *(unsigned long *)((char *)hdr - FOOTER_SIZE);
+    return (header *)((char *)hdr - prev_size - HEADER_SIZE);
+}
+
+/* This function merges the free block hdr with a free block on either
+ * side and returns the header of the merged block. Since every free is
+ * merged right away, there is never more than one on each side.
+ */
+header *coalesce(header *hdr) {
+    if (!is_last(hdr) && !is_used(next_header(hdr))) {
+        note_merge(hdr, next_header(hdr));
+        hdr->size += HEADER_SIZE + get_size(next_header(hdr));
+        num_header -= 1;
+        STAT(stats.coalesces++);
+    }
+    if (hdr->size & PREV_FREE) {
+        header *prev = prev_header(hdr);
+        prev->size += HEADER_SIZE + get_size(hdr);
+        note_merge(prev, hdr);
+        hdr = prev;
+        num_header -= 1;
+        STAT(stats.coalesces++);
+    }
+    return hdr;
+}
+#else
+/* This function walks the heap once and merges every run of free
+ * blocks into its first block.
+ */
+void coalesce_all(void) {
+    header *cur = (header *)segment_start;
+    while (true) {
+        while (!is_used(cur) && !is_last(cur) && !is_used(next_header(cur))) {
+            note_merge(cur, next_header(cur));
+            cur->size += HEADER_SIZE + get_size(next_header(cur));
+            num_header -= 1;
+            STAT(stats.coalesces++);
+        }
+        if (is_last(cur)) break;
+        cur = next_header(cur);
+    }
+    unmerged = false;
+}
+#endif
+
+#ifdef NEXT_FIT
+/* This function returns the first free block with at least needed bytes
+ * of payload after the rover, going round to the start of the heap, or
+ * NULL if there is none. The last block is only taken when nothing else
+ * fits; it always fits, so the rover would otherwise never leave it.
+ */
+header *find_fit(size_t needed) {
+    header *ithdr = rover; //start where the last search stopped
+    header *last = NULL;
+    int cnt;
+    for (cnt = 0; cnt < num_header; cnt++) {
+        if (is_last(ithdr)) {
+            last = ithdr;
+            ithdr = (header *)segment_start;
+            continue;
+        }
+        if (!is_used(ithdr) && needed <= get_size(ithdr)) break;
+        ithdr = next_header(ithdr);
+    }
+    STAT(stats.searches++; stats.search_steps += cnt + (cnt < num_header));
+    if (cnt == num_header) ithdr = !is_used(last) && needed <= get_size(last) ? last : NULL;
+    if (ithdr != NULL) rover = ithdr;
+    return ithdr;
+}
+#else
+/* This function returns a free block with at least needed bytes of
+ * payload, or NULL if there is none. With FIT_CANDIDATES of 1 that is
+ * the first one; otherwise the smallest of the first FIT_CANDIDATES
+ * that fit, or one that fits so closely it will not be split.
+ */
+header *find_fit(size_t needed) {
+    header *ithdr = (header *)segment_start; //start from the beg
+    header *fit = NULL;
+    int found = 0;
+    int cnt;
+    for (cnt = 0; cnt < num_header; cnt++) {
+        if (!is_used(ithdr) && needed <= get_size(ithdr)) {
+            if (fit == NULL || get_size(ithdr) < get_size(fit)) fit = ithdr;
+            if (++found == FIT_CANDIDATES || get_size(ithdr) - needed < MIN_BLOCK) break;
+        }
+        ithdr = next_header(ithdr);
+    }
+    STAT(stats.searches++; stats.search_steps += cnt + (cnt < num_header));
+    return fit;
+}
+#endif
+
 /* 
  * This must be called by a client before making any allocation
  * requests.  The function returns true if initialization was 
@@ -38,116 +234,329 @@ size_t addpad(size_t size, size_t mult) {
  * against a set of of test scripts, our test harness calls 
  * myinit before starting each new script.
  */
-bool myinit(void *heap_start, size_t heap_size) {
+bool heap_init(void *heap_start, size_t heap_size) {
     //return false if heap_size is less than header size
-    if (heap_size < HEADER_SIZE) return false;
+    if (heap_size < MIN_BLOCK) return false;
 
-    segment_size = heap_size;
+    segment_size = heap_size & ~(size_t)(ALIGNMENT - 1);
     segment_start = heap_start;
     
     //make first header
     header *first = (header *)segment_start;
     nbytes_inuse = 0; //initiate payload bytes in-use to 0
     nused = HEADER_SIZE; //8 bytes used to store header
-    first->size = segment_size - HEADER_SIZE; //lsb = 0
+    first->size = segment_size - HEADER_SIZE;
+    set_free(first);
     num_header = 1;
+    memset(&stats, 0, sizeof(stats));
+#ifdef NEXT_FIT
+    rover = first;
+#endif
+#ifdef DEFERRED_COALESCE
+    unmerged = false;
+#endif
     
     return true;
 }
 
+/* This function marks hdr, which has at least needed bytes, as
+ * allocated, splitting off what it does not need, and returns its payload.
+ */
+void *place(header *hdr, size_t needed) {
+    split_block(hdr, needed);
+    set_used(hdr);
+    nbytes_inuse += get_size(hdr);
+    size_t reach = (char *)next_header(hdr) - (char *)segment_start;
+    if (reach > nused) nused = reach;
+    STAT(stats_note_in_use(&stats, nbytes_inuse));
+    return (char *)hdr + HEADER_SIZE;
+}
+
 /* This function takes in a requested size and allocates memory
  * on the heap. Because it is an implicit implementation, it
  * iterates through every header/block, and when the function finishes, a
  * pointer to a memory location is returned. If there are no more free
  * space, a NULL ptr is returned.
  */
-void *mymalloc(size_t requested_size) {
+void *heap_malloc(size_t requested_size) {
     if (requested_size <= 0 || requested_size > MAX_REQUEST_SIZE) { //exceptions
         return NULL;
     }
     //align requested_size
     size_t needed = addpad(requested_size, ALIGNMENT);
     //iterate through headers and check space available using first-fit
-    header *ithdr = (header *)segment_start; //start from the beg
-
-    int cnt;
-    bool block = false;
-    for (cnt = 0; cnt < num_header; cnt++) {    
-        if (needed <= ithdr->size && !(ithdr->size & 0x1)) {
-            //if header is the last one, update payload size
-            if (cnt == num_header - 1) {
-                nused += needed;
-                ithdr->size = needed;
-                nbytes_inuse += needed;
-            } else nbytes_inuse += ithdr->size;
-            ithdr->size |= 0x1;
-            block = true;
-            break;
-        } //else increment ptr by header size:
-        void *temp; 
-        if (ithdr->size & 0x1) { //used
-            temp = (char *)ithdr + HEADER_SIZE - 1 + ithdr->size;
-        } else { //if not used
-            temp = (char *)ithdr + HEADER_SIZE + ithdr->size;
-        }
-        ithdr = (header *)temp;
-    }
-    //attach new header at end
-    if ((cnt == num_header - 1) && block && (segment_size - nused >= HEADER_SIZE)) {
-        void *nxthdr = (char *)ithdr + ithdr->size + HEADER_SIZE - 1; //to acct for set lsb
-        header *new_hdr = (header *)nxthdr;
-        new_hdr->size = segment_size - nused - HEADER_SIZE; //subtract curr header size
-        nused += HEADER_SIZE;
-        num_header += 1;
+    header *hdr = find_fit(needed);
+#ifdef DEFERRED_COALESCE
+    //only the last block is left (or nothing fits): merge what was freed and look again
+    //before reaching further into the segment
+    if ((hdr == NULL || is_last(hdr)) && unmerged) {
+        coalesce_all();
+        hdr = find_fit(needed);
     }
-    if (block) return (char *)ithdr + HEADER_SIZE;
-    
+#endif
+    if (hdr) return place(hdr, needed);
+
     //if we reach here, we know that requested_size is too big
     //for any of our available blocks, so just return NULL
     return NULL;
 }
 
+/* This function returns how far into the free block hdr a block of
+ * needed bytes must start for its payload to lie on a multiple of
+ * align, leaving the slack in front of it big enough to be a free
+ * block of its own. Returns SIZE_MAX if the block is too small.
+ */
+size_t aligned_slack(header *hdr, size_t needed, size_t align) {
+    uintptr_t payload = (uintptr_t)hdr + HEADER_SIZE;
+    uintptr_t aligned = addpad(payload, align);
+    while (aligned != payload && aligned - payload < MIN_BLOCK) {
+        aligned += align;
+    }
+    size_t slack = aligned - payload;
+    return slack <= get_size(hdr) && get_size(hdr) - slack >= needed ? slack : SIZE_MAX;
+}
+
+/* This function returns the first free block that can hold needed
+ * bytes with the payload on a multiple of align, or NULL if there is
+ * none. Every policy takes the first such block: the offset makes
+ * sizes alone a poor guide to which one wastes least.
+ */
+header *find_aligned_fit(size_t needed, size_t align) {
+    header *ithdr = (header *)segment_start;
+    int cnt;
+    for (cnt = 0; cnt < num_header; cnt++) {
+        if (!is_used(ithdr) && aligned_slack(ithdr, needed, align) != SIZE_MAX) break;
+        ithdr = next_header(ithdr);
+    }
+    STAT(stats.searches++; stats.search_steps += cnt + (cnt < num_header));
+    return cnt < num_header ? ithdr : NULL;
+}
+
+/* This function allocates requested_size bytes whose payload lies on a
+ * multiple of align, a power of two. The slack in front of the payload
+ * becomes a free block of its own, and the tail is split off as in
+ * heap_malloc. The block is an ordinary one from then on.
+ */
+void *heap_memalign(size_t align, size_t requested_size) {
+    if (requested_size <= 0 || requested_size > MAX_REQUEST_SIZE || align > MAX_REQUEST_SIZE) return NULL;
+    size_t needed = addpad(requested_size, ALIGNMENT);
+    header *hdr = find_aligned_fit(needed, align);
+#ifdef DEFERRED_COALESCE
+    if (hdr == NULL && unmerged) {
+        coalesce_all();
+        hdr = find_aligned_fit(needed, align);
+    }
+#endif
+    if (hdr == NULL) return NULL;
+
+    size_t slack = aligned_slack(hdr, needed, align);
+    if (slack != 0) {
+        header *block = (header *)((char *)hdr + slack);
+        block->size = get_size(hdr) - slack;
+        hdr->size = (slack - HEADER_SIZE) | (hdr->size & FLAG_BITS);
+        set_free(hdr);
+        num_header += 1;
+        STAT(stats.splits++);
+        hdr = block;
+    }
+    return place(hdr, needed);
+}
+
 /*
  * Takes care of freeing block at the pointer address.
  * If a null pointer is taken in, we simply return.
  */
-void myfree(void *ptr) {
+void heap_free(void *ptr) {
     if (ptr) { //exception: check that ptr is non-null
-        //update the header only (size shouldn't change)
         header *hdr = (header *)((char *)ptr - HEADER_SIZE);
-        hdr->size ^= 0x1; //set bit to 0
-        nbytes_inuse -= hdr->size;
+        nbytes_inuse -= get_size(hdr);
+#ifndef DEFERRED_COALESCE
+        hdr = coalesce(hdr);
+#else
+        unmerged = true; //left for the next sweep
+#endif
+        set_free(hdr);
     }
 }
 
-/* This function reallocates memory given a new size. It does
- * in-place realloc if size is big enough. If not, it calls
- * on mymalloc to move memory elsewhere.
+/* This function grows the block at hdr to at least needed bytes by
+ * taking in the free blocks right after it. Returns false, changing
+ * nothing, if they are too small.
  */
-void *myrealloc(void *old_ptr, size_t new_size) {
+bool grow_block(header *hdr, size_t needed) {
+    size_t size = get_size(hdr);
+    size_t avail = size;
+    int absorbed = 0;
+    for (header *cur = hdr; avail < needed && !is_last(cur) && !is_used(next_header(cur)); absorbed++) {
+        cur = next_header(cur);
+        avail += HEADER_SIZE + get_size(cur);
+        note_merge(hdr, cur);
+    }
+    if (avail < needed) return false;
+    hdr->size += avail - size;
+    num_header -= absorbed;
+    STAT(stats.coalesces += absorbed);
+    nbytes_inuse -= size;
+    place(hdr, needed);
+    return true;
+}
+
+#ifndef DEFERRED_COALESCE
+/* This function grows the allocated block hdr to at least needed bytes
+ * by taking in the free block before it, and the one after it if that
+ * is free too, sliding the payload down with memmove. Only the old
+ * payload is moved. Returns the header of the grown block, or NULL,
+ * changing nothing, if they are too small. Deferred coalescing keeps no
+ * footers, so there the block before cannot be found.
+ */
+header *grow_left(header *hdr, size_t needed) {
+    if (!(hdr->size & PREV_FREE)) return NULL;
+    size_t size = get_size(hdr);
+    header *prev = prev_header(hdr);
+    header *next = next_header(hdr);
+    bool take_next = !is_last(hdr) && !is_used(next);
+    size_t avail = get_size(prev) + HEADER_SIZE + size + (take_next ? HEADER_SIZE + get_size(next) : 0);
+    if (avail < needed) return NULL;
+    note_merge(prev, hdr);
+    if (take_next) note_merge(prev, next);
+    memmove((char *)prev + HEADER_SIZE, (char *)hdr + HEADER_SIZE, size);
+    prev->size = avail | (prev->size & FLAG_BITS);
+    num_header -= take_next ? 2 : 1;
+    STAT(stats.coalesces += take_next ? 2 : 1);
+    STAT(stats.realloc_copied += size);
+    nbytes_inuse -= size;
+    place(prev, needed);
+    return prev;
+}
+#endif
+
+/* This function cuts the allocated block hdr down to needed bytes and
+ * frees the tail, which merges with a free block after it (or is left
+ * for the next sweep).
+ */
+void shrink_block(header *hdr, size_t needed) {
+    size_t size = get_size(hdr);
+    split_block(hdr, needed);
+    if (get_size(hdr) == size) return;
+    nbytes_inuse -= size - get_size(hdr);
+#ifndef DEFERRED_COALESCE
+    set_free(coalesce(next_header(hdr)));
+#else
+    unmerged = true;
+#endif
+}
+
+/* This function reallocates memory given a new size. A block that is
+ * big enough gives back what it no longer needs. One that is not grows
+ * in place if the blocks after it are free, or (with immediate
+ * coalescing) the block before it; only then does it move elsewhere,
+ * copying just its old payload.
+ */
+void *heap_realloc(void *old_ptr, size_t new_size) {
     if (!old_ptr) { 
-        void *new_ptr = mymalloc(new_size);
+        void *new_ptr = heap_malloc(new_size);
         return new_ptr;
     }
     if (new_size == 0) {
-        myfree(old_ptr);
+        heap_free(old_ptr);
         return NULL;
     }
-    //check if current block is large enough
+    if (new_size > MAX_REQUEST_SIZE) return NULL;
+    //check if current block is large enough, or can be made so
     header *curhdr = (header *)((char *)old_ptr - HEADER_SIZE);
-    if ((curhdr->size - 1) >= new_size) {
+    size_t old_size = get_size(curhdr);
+    size_t needed = addpad(new_size, ALIGNMENT);
+    if (old_size >= needed) {
+        shrink_block(curhdr, needed);
+        STAT(stats.realloc_in_place++);
         return old_ptr;
     }
+    if (grow_block(curhdr, needed)) {
+        STAT(stats.realloc_in_place++);
+        return old_ptr;
+    }
+#ifndef DEFERRED_COALESCE
+    header *grown = grow_left(curhdr, needed);
+    if (grown != NULL) {
+        STAT(stats.realloc_in_place++);
+        return (char *)grown + HEADER_SIZE;
+    }
+#endif
     //if not, use memcpy to move the data to a block (already aligned)
-    void *new_ptr = mymalloc(new_size); 
+    void *new_ptr = heap_malloc(new_size); 
     if (!new_ptr) return NULL;
 
-    memcpy(new_ptr, old_ptr, new_size);
-    myfree(old_ptr);
+    memcpy(new_ptr, old_ptr, old_size);
+    heap_free(old_ptr);
+    STAT(stats.realloc_moved++);
+    STAT(stats.realloc_copied += old_size);
     
     return new_ptr;
 }
 
+/* The functions below are the allocator.h interface. Each one takes
+ * heap_lock around the matching heap_ function, so the heap can be
+ * shared between threads.
+ */
+bool myinit(void *heap_start, size_t heap_size) {
+    pthread_mutex_lock(&heap_lock);
+    bool ok = heap_init(heap_start, heap_size);
+    pthread_mutex_unlock(&heap_lock);
+    return ok;
+}
+
+void *mymalloc(size_t requested_size) {
+    pthread_mutex_lock(&heap_lock);
+    void *ptr = heap_malloc(requested_size);
+    STAT(stats_count(&stats, &stats.mallocs, requested_size, ptr == NULL));
+    pthread_mutex_unlock(&heap_lock);
+    return ptr;
+}
+
+//Alignments of up to ALIGNMENT are what mymalloc gives anyway.
+void *mymemalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) return NULL;
+    if (alignment <= ALIGNMENT) return mymalloc(size);
+    pthread_mutex_lock(&heap_lock);
+    void *ptr = heap_memalign(alignment, size);
+    STAT(stats_count(&stats, &stats.mallocs, size, ptr == NULL));
+    pthread_mutex_unlock(&heap_lock);
+    return ptr;
+}
+
+void myfree(void *ptr) {
+    pthread_mutex_lock(&heap_lock);
+    heap_free(ptr);
+    STAT(if (ptr != NULL) stats.frees++);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void *myrealloc(void *old_ptr, size_t new_size) {
+    pthread_mutex_lock(&heap_lock);
+    void *ptr = heap_realloc(old_ptr, new_size);
+    STAT(stats_count(&stats, !old_ptr ? &stats.mallocs : new_size == 0 ? &stats.frees : &stats.reallocs,
+                     new_size, ptr == NULL && new_size != 0));
+    pthread_mutex_unlock(&heap_lock);
+    return ptr;
+}
+
+bool mystats(heap_stats *out) {
+    pthread_mutex_lock(&heap_lock);
+    *out = stats;
+    out->bytes_in_use = nbytes_inuse;
+    out->peak_footprint = nused;
+    out->num_blocks = num_header;
+    pthread_mutex_unlock(&heap_lock);
+    return STATS_ENABLED;
+}
+
+bool validate_heap() {
+    pthread_mutex_lock(&heap_lock);
+    bool ok = check_heap();
+    pthread_mutex_unlock(&heap_lock);
+    return ok;
+}
+
 /* 
  * Return true if all is ok, or false otherwise.
  * This function is called periodically by the test
@@ -155,7 +564,7 @@ void *myrealloc(void *old_ptr, size_t new_size) {
  * You can also use the breakpoint() function to stop
  * in the debugger - e.g. if (something_is_wrong) breakpoint();
  */
-bool validate_heap() {
+bool check_heap(void) {
     if (nused > segment_size) {
         printf("Oops! Have used more heap than total available?!\n");
         breakpoint();
@@ -165,24 +574,38 @@ bool validate_heap() {
     header *cur = (header *)segment_start;
     size_t segment_bytes = 0;
     size_t validate_payload = 0;
+#ifndef DEFERRED_COALESCE
+    bool prev_free = false;
+#endif
     for (int i = 0; i < num_header; i++) {
         //location - must be within address boundaries
-        if ((char *)cur > (char *)segment_start + segment_size) {
+        if ((char *)cur >= (char *)segment_start + segment_size) {
             printf("Oops! Address is not within heap bounds.\n");
             breakpoint();
             return false;
         }
-        segment_bytes += HEADER_SIZE;
-        void *temp;
-        if (cur->size & 0x1) { //used
-            temp = (char *)cur + HEADER_SIZE - 1 + cur->size;
-            segment_bytes += cur->size - 1;
-            validate_payload += cur->size - 1;
-        } else { //if not used, free
-            temp = (char *)cur + HEADER_SIZE + cur->size;
-            segment_bytes += cur->size;
+        segment_bytes += HEADER_SIZE + get_size(cur);
+        if (is_used(cur)) validate_payload += get_size(cur);
+#ifndef DEFERRED_COALESCE
+        //coalescing - no two free blocks in a row, and the flags and footers agree
+        if (prev_free && !is_used(cur)) {
+            printf("Oops! Free blocks at %p and before it were not merged.\n", cur);
+            breakpoint();
+            return false;
         }
-        cur = (header *)temp;
+        if (prev_free != ((cur->size & PREV_FREE) != 0)) {
+            printf("Oops! Block at %p has the wrong prev-free flag.\n", cur);
+            breakpoint();
+            return false;
+        }
+        if (!is_used(cur) && *(unsigned long *)((char *)next_header(cur) - FOOTER_SIZE) != get_size(cur)) {
+            printf("Oops! Footer of free block at %p does not match its header.\n", cur);
+            breakpoint();
+            return false;
+        }
+        prev_free = !is_used(cur);
+#endif
+        cur = next_header(cur);
     }
     //size - check if all segment_size is accounted for
     if (segment_bytes != segment_size) {
@@ -215,13 +638,8 @@ void dump_heap() {
     printf("\n");
     header *cur = (header *)segment_start;
     for (int i = 0; i < num_header; i++) {
-        printf("Header %d (%p): %lu\n", i, cur, cur->size);
-        void *temp; //extract the following into helper function!
-        if (cur->size & 0x1) { //used
-            temp = (char *)cur + HEADER_SIZE - 1 + cur->size;
-        } else { //if not used
-            temp = (char *)cur + HEADER_SIZE + cur->size;
-        }
-        cur = (header *)temp;
+        printf("Header %d (%p): %lu %s%s\n", i, cur, get_size(cur), is_used(cur) ? "used" : "free",
+               cur->size & PREV_FREE ? ", prev free" : "");
+        cur = next_header(cur);
     }
 }
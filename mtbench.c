@@ -0,0 +1,383 @@
+/*
+ * File: mtbench.c
+ * Measures how allocator throughput scales with the number of threads.
+ * Every thread replays the given scripts on its own set of block ids
+ * against one shared heap, and the table shows operations per second,
+ * the speedup over one thread and the parallel efficiency for 1 to N
+ * threads.
+ * With -c it instead runs 1 to N producer/consumer pairs: each producer
+ * allocates messages with the sizes the scripts request and passes
+ * them to its consumer, which frees them, so every free is made by a
+ * thread other than the one that allocated the block. The table shows
+ * messages per second and the mean time a consumer spent in myfree.
+ * -a splits the heap into that many arenas (myinit_arenas), and -A
+ * instead runs max_threads threads over 1 to max_threads arenas.
+ *
+ * usage: mtbench_<allocator> [-c] [-a arenas | -A] [-t max_threads] [-r repeats] script...
+ */
+#include "allocator.h"
+#include "script.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HEAP_PER_THREAD ((size_t)1 << 28) //address space only, pages are touched on use
+#define RING_SIZE 256 //messages in flight between a producer and its consumer
+
+//only some allocators have these, so the benchmark still links without them
+bool myinit_arenas(void *segment_start, size_t segment_size, int narenas) __attribute__((weak));
+bool myinit_anonymous(void *segment_start, size_t segment_size, int narenas) __attribute__((weak));
+
+static int num_arenas; //0 means a plain myinit
+
+typedef struct {
+    script *scripts;
+    int num_scripts;
+    int repeats;
+    pthread_barrier_t *start;
+    long ops; //operations this thread completed
+    double begin, end; //when this thread started and finished replaying
+    bool failed;
+} worker;
+
+/* One producer/consumer pair. The ring is only written by the
+ * producer at tail and only emptied by the consumer at head.
+ */
+typedef struct {
+    void *ring[RING_SIZE];
+    unsigned long head;
+    unsigned long tail;
+    size_t *sizes; //message sizes, used in turn
+    int num_sizes;
+    long messages; //how many the producer sends
+    pthread_barrier_t *start;
+    double begin, end; //producer start and consumer finish
+    double free_time; //seconds the consumer spent in myfree
+    bool failed;
+} pipe_pair;
+
+/* This function resets the heap with the arena count chosen on the
+ * command line. The segment is private anonymous memory, so an
+ * allocator that can make use of that is told so.
+ */
+bool init_heap(void *segment, size_t size) {
+    if (myinit_anonymous != NULL) return myinit_anonymous(segment, size, num_arenas > 0 ? num_arenas : 1);
+    if (num_arenas == 0) return myinit(segment, size);
+    return myinit_arenas(segment, size, num_arenas);
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* This function replays one script, then frees whatever the script
+ * left allocated so the next pass starts from the same state.
+ */
+bool replay(script *s, void **blocks, long *ops) {
+    memset(blocks, 0, s->num_ids * sizeof(void *));
+    for (int i = 0; i < s->num_ops; i++) {
+        script_op *op = &s->ops[i];
+        uint32_t id = OP_ID(op);
+        if (OP_TYPE(op) == OP_MALLOC) {
+            blocks[id] = mymalloc(op->size);
+            if (blocks[id] == NULL) {
+                if (op->size != 0) return false;
+                continue;
+            }
+            *(char *)blocks[id] = (char)id; //touch it like a client would
+        } else if (OP_TYPE(op) == OP_REALLOC) {
+            void *ptr = myrealloc(blocks[id], op->size);
+            if (ptr == NULL && op->size != 0) return false;
+            blocks[id] = ptr;
+        } else {
+            myfree(blocks[id]);
+            blocks[id] = NULL;
+        }
+    }
+    for (int id = 0; id < s->num_ids; id++) {
+        myfree(blocks[id]);
+    }
+    *ops += s->num_ops;
+    return true;
+}
+
+void *run_worker(void *arg) {
+    worker *w = arg;
+    int max_ids = 0;
+    for (int i = 0; i < w->num_scripts; i++) {
+        if (w->scripts[i].num_ids > max_ids) max_ids = w->scripts[i].num_ids;
+    }
+    void **blocks = malloc((max_ids + 1) * sizeof(void *));
+
+    pthread_barrier_wait(w->start);
+    w->begin = now_sec();
+    for (int rep = 0; rep < w->repeats && !w->failed; rep++) {
+        for (int i = 0; i < w->num_scripts && !w->failed; i++) {
+            if (!replay(&w->scripts[i], blocks, &w->ops)) w->failed = true;
+        }
+    }
+    w->end = now_sec();
+    free(blocks);
+    return NULL;
+}
+
+/* This function runs nthreads workers on a freshly initialized heap
+ * and stores their combined operations per second in throughput.
+ * Returns false if an allocation failed or the heap ended up invalid.
+ */
+bool measure(void *segment, script *scripts, int num_scripts, int repeats, int nthreads,
+             double *throughput) {
+    if (!init_heap(segment, HEAP_PER_THREAD * nthreads)) {
+        printf("myinit failed for %d threads.\n", nthreads);
+        return false;
+    }
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    worker workers[nthreads];
+    pthread_t tids[nthreads];
+    for (int t = 0; t < nthreads; t++) {
+        workers[t] = (worker){scripts, num_scripts, repeats, &start, 0, 0, 0, false};
+        pthread_create(&tids[t], NULL, run_worker, &workers[t]);
+    }
+    pthread_barrier_wait(&start);
+    long ops = 0;
+    bool failed = false;
+    double begin = 0, end = 0;
+    //the clock runs from the first thread starting to the last one finishing
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(tids[t], NULL);
+        ops += workers[t].ops;
+        failed |= workers[t].failed;
+        if (t == 0 || workers[t].begin < begin) begin = workers[t].begin;
+        if (workers[t].end > end) end = workers[t].end;
+    }
+    double elapsed = end - begin;
+    pthread_barrier_destroy(&start);
+
+    if (failed) {
+        printf("Allocation failed with %d threads.\n", nthreads);
+        return false;
+    }
+    if (!validate_heap()) {
+        printf("Heap is inconsistent after %d threads.\n", nthreads);
+        return false;
+    }
+    *throughput = ops / elapsed;
+    return true;
+}
+
+void *run_producer(void *arg) {
+    pipe_pair *p = arg;
+    pthread_barrier_wait(p->start);
+    p->begin = now_sec();
+    for (long i = 0; i < p->messages; i++) {
+        void *msg = mymalloc(p->sizes[i % p->num_sizes]);
+        if (msg == NULL) p->failed = true;
+        else *(char *)msg = (char)i;
+        while (p->tail - __atomic_load_n(&p->head, __ATOMIC_ACQUIRE) == RING_SIZE) {
+            sched_yield();
+        }
+        p->ring[p->tail % RING_SIZE] = msg;
+        __atomic_store_n(&p->tail, p->tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* The consumer frees whatever is waiting in the ring in one go and
+ * times the whole batch, so the clock is not read once per free.
+ */
+void *run_consumer(void *arg) {
+    pipe_pair *p = arg;
+    pthread_barrier_wait(p->start);
+    while (p->head < (unsigned long)p->messages) {
+        unsigned long tail = __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE);
+        if (tail == p->head) {
+            sched_yield();
+            continue;
+        }
+        double begin = now_sec();
+        for (unsigned long i = p->head; i < tail; i++) {
+            myfree(p->ring[i % RING_SIZE]);
+        }
+        p->free_time += now_sec() - begin;
+        __atomic_store_n(&p->head, tail, __ATOMIC_RELEASE);
+    }
+    p->end = now_sec();
+    return NULL;
+}
+
+/* This function runs npairs producer/consumer pairs on a freshly
+ * initialized heap and stores the combined messages per second and the
+ * mean nanoseconds per myfree. Returns false if an allocation failed or
+ * the heap ended up invalid.
+ */
+bool measure_pipeline(void *segment, size_t *sizes, int num_sizes, long messages, int npairs,
+                      double *throughput, double *free_ns) {
+    if (!init_heap(segment, HEAP_PER_THREAD * npairs)) {
+        printf("myinit failed for %d pairs.\n", npairs);
+        return false;
+    }
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, 2 * npairs);
+    pipe_pair *pairs = calloc(npairs, sizeof(pipe_pair));
+    pthread_t tids[2 * npairs];
+    for (int t = 0; t < npairs; t++) {
+        pairs[t].sizes = sizes;
+        pairs[t].num_sizes = num_sizes;
+        pairs[t].messages = messages;
+        pairs[t].start = &start;
+        pthread_create(&tids[2 * t], NULL, run_producer, &pairs[t]);
+        pthread_create(&tids[2 * t + 1], NULL, run_consumer, &pairs[t]);
+    }
+    bool failed = false;
+    double begin = 0, end = 0, free_time = 0;
+    for (int t = 0; t < npairs; t++) {
+        pthread_join(tids[2 * t], NULL);
+        pthread_join(tids[2 * t + 1], NULL);
+        failed |= pairs[t].failed;
+        free_time += pairs[t].free_time;
+        if (t == 0 || pairs[t].begin < begin) begin = pairs[t].begin;
+        if (pairs[t].end > end) end = pairs[t].end;
+    }
+    free(pairs);
+    pthread_barrier_destroy(&start);
+
+    if (failed) {
+        printf("Allocation failed with %d pairs.\n", npairs);
+        return false;
+    }
+    if (!validate_heap()) {
+        printf("Heap is inconsistent after %d pairs.\n", npairs);
+        return false;
+    }
+    *throughput = messages * npairs / (end - begin);
+    *free_ns = free_time * 1e9 / (messages * npairs);
+    return true;
+}
+
+/* This function prints throughput, speedup and efficiency for 1 to
+ * max_threads threads replaying the scripts.
+ */
+int run_replays(void *segment, script *scripts, int num_scripts, int repeats, int max_threads) {
+    //one untimed pass so the single-thread row does not pay for first-touch page faults
+    double throughput;
+    if (!measure(segment, scripts, num_scripts, 1, 1, &throughput)) return 1;
+
+    printf("%7s %12s %8s %10s\n", "threads", "Mops/s", "speedup", "efficiency");
+    double base = 0;
+    for (int nthreads = 1; nthreads <= max_threads; nthreads++) {
+        if (!measure(segment, scripts, num_scripts, repeats, nthreads, &throughput)) return 1;
+        if (nthreads == 1) base = throughput;
+        double speedup = throughput / base;
+        printf("%7d %12.2f %8.2f %9.0f%%\n", nthreads, throughput / 1e6, speedup,
+               100 * speedup / nthreads);
+    }
+    return 0;
+}
+
+/* This function prints the throughput of nthreads threads replaying
+ * the scripts as the heap is split into 1 to nthreads arenas.
+ */
+int run_arena_sweep(void *segment, script *scripts, int num_scripts, int repeats, int nthreads) {
+    double throughput;
+    num_arenas = 1;
+    if (!measure(segment, scripts, num_scripts, 1, 1, &throughput)) return 1;
+
+    printf("%7d threads\n%7s %12s\n", nthreads, "arenas", "Mops/s");
+    for (num_arenas = 1; num_arenas <= nthreads; num_arenas++) {
+        if (!measure(segment, scripts, num_scripts, repeats, nthreads, &throughput)) return 1;
+        printf("%7d %12.2f\n", num_arenas, throughput / 1e6);
+    }
+    return 0;
+}
+
+/* This function runs the producer/consumer table using the sizes of
+ * every malloc and realloc in the scripts as message sizes.
+ */
+int run_pipelines(void *segment, script *scripts, int num_scripts, int repeats, int max_pairs) {
+    int num_sizes = 0;
+    for (int i = 0; i < num_scripts; i++) {
+        num_sizes += scripts[i].num_ops;
+    }
+    size_t *sizes = malloc(num_sizes * sizeof(size_t));
+    num_sizes = 0;
+    for (int i = 0; i < num_scripts; i++) {
+        for (int j = 0; j < scripts[i].num_ops; j++) {
+            script_op *op = &scripts[i].ops[j];
+            if (OP_TYPE(op) != OP_FREE && op->size != 0) sizes[num_sizes++] = op->size;
+        }
+    }
+    long messages = (long)num_sizes * repeats;
+
+    double throughput, free_ns;
+    if (!measure_pipeline(segment, sizes, num_sizes, num_sizes, 1, &throughput, &free_ns)) return 1;
+
+    printf("%7s %12s %10s\n", "pairs", "Mmsg/s", "free ns");
+    for (int npairs = 1; npairs <= max_pairs; npairs++) {
+        if (!measure_pipeline(segment, sizes, num_sizes, messages, npairs, &throughput, &free_ns)) {
+            return 1;
+        }
+        printf("%7d %12.2f %10.1f\n", npairs, throughput / 1e6, free_ns);
+    }
+    free(sizes);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int repeats = 20;
+    bool pipelines = false;
+    bool sweep = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "ca:At:r:")) != -1) {
+        if (opt == 'c') pipelines = true;
+        else if (opt == 'a') num_arenas = atoi(optarg);
+        else if (opt == 'A') sweep = true;
+        else if (opt == 't') max_threads = atoi(optarg);
+        else if (opt == 'r') repeats = atoi(optarg);
+        else break;
+    }
+    if (optind >= argc || max_threads < 1 || repeats < 1 || num_arenas < 0) {
+        printf("usage: %s [-c] [-a arenas | -A] [-t max_threads] [-r repeats] script...\n", argv[0]);
+        return 1;
+    }
+    if ((num_arenas > 0 || sweep) && myinit_arenas == NULL) {
+        printf("This allocator has no arenas.\n");
+        return 1;
+    }
+
+    int num_scripts = argc - optind;
+    script scripts[num_scripts];
+    for (int i = 0; i < num_scripts; i++) {
+        if (!read_script(argv[optind + i], &scripts[i])) return 1;
+    }
+
+    void *segment = mmap(NULL, HEAP_PER_THREAD * max_threads, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (segment == MAP_FAILED) {
+        printf("Could not map a %zu MB heap.\n", (HEAP_PER_THREAD * max_threads) >> 20);
+        return 1;
+    }
+
+    int status = 0;
+    if (sweep) {
+        status = run_arena_sweep(segment, scripts, num_scripts, repeats, max_threads);
+    } else if (pipelines) {
+        status = run_pipelines(segment, scripts, num_scripts, repeats, max_threads);
+    } else {
+        status = run_replays(segment, scripts, num_scripts, repeats, max_threads);
+    }
+
+    munmap(segment, HEAP_PER_THREAD * max_threads);
+    for (int i = 0; i < num_scripts; i++) {
+        free_script(&scripts[i]);
+    }
+    return status;
+}
@@ -0,0 +1,338 @@
+/*
+ * File: preload.c
+ * Runs an unmodified program on one of our allocators. Built together
+ * with an allocator into libmyheap_<allocator>.so and loaded with
+ * LD_PRELOAD, it defines malloc, free, realloc, calloc and the aligned
+ * variants on top of mymalloc, myfree and myrealloc (and mycalloc and
+ * mymemalign, if the allocator has them). The heap is one large mmap'd segment reserved
+ * on the first call; only the pages the allocator touches are ever
+ * backed. Blocks the allocator maps
+ * apart from the segment (see mymapped) are its too. An allocator that
+ * grows (see mygrows) starts with a small segment instead.
+ *
+ * Environment:
+ *   MYHEAP_SIZE    segment size in MB (default 16384, or 64 if the
+ *                  allocator grows)
+ *   MYHEAP_ARENAS  arenas to split the heap into, if the allocator has them
+ *   MYHEAP_TRACE   file to log every call to; convert_trace turns the
+ *                  log into a script or trace for bench and mtbench
+ *   MYHEAP_PROFILE file to write a heap profile of the blocks still
+ *                  allocated to at exit, if the allocator has myprofile
+ *   MYHEAP_PROFILE_RATE  mean bytes allocated between samples (default 524288)
+ *
+ * usage: MYHEAP_TRACE=app.log LD_PRELOAD=./libmyheap_explicit.so program...
+ */
+#include "allocator.h"
+#include "script.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define DEFAULT_SEGMENT_MB 16384
+#define GROWING_SEGMENT_MB 64
+#define DEFAULT_PROFILE_RATE (512 * 1024)
+#define LOG_BUFFER 4096 //records a thread collects before writing them out
+#define ALIGNED_BUCKETS 1024
+
+#define EXPORT __attribute__((visibility("default")))
+
+bool myinit_arenas(void *segment_start, size_t segment_size, int narenas) __attribute__((weak));
+bool myinit_anonymous(void *segment_start, size_t segment_size, int narenas) __attribute__((weak));
+bool myprofile(size_t rate) __attribute__((weak));
+bool myprofile_dump(const char *path) __attribute__((weak));
+bool mymapped(void *ptr) __attribute__((weak));
+bool mygrows(void) __attribute__((weak));
+void *mycalloc(size_t count, size_t size) __attribute__((weak));
+void *mymemalign(size_t alignment, size_t size) __attribute__((weak));
+
+typedef struct aligned_block { //a block handed out at an address inside it
+    void *ptr; //what the program was given
+    void *block; //what mymalloc returned
+    size_t size;
+    struct aligned_block *nxt;
+} aligned_block;
+
+typedef struct {
+    call_record *records;
+    int count;
+} log_buffer;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static char *segment_start;
+static size_t segment_size;
+
+static aligned_block *aligned[ALIGNED_BUCKETS];
+static int num_aligned; //lets free skip the table while it is empty
+static pthread_mutex_t aligned_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int log_fd = -1;
+static uint64_t log_seq;
+static pthread_key_t log_key; //flushes a thread's buffer when it exits
+static __thread log_buffer buffer;
+
+//This function reads a positive number from the environment.
+long env_number(const char *name, long fallback) {
+    const char *value = getenv(name);
+    long n = value ? strtol(value, NULL, 10) : 0;
+    return n > 0 ? n : fallback;
+}
+
+//This function writes out the records the calling thread has collected.
+void flush_log(log_buffer *buf) {
+    if (buf->count == 0) return;
+    //O_APPEND makes every write land whole at the end, whatever other threads do
+    ssize_t ignored = write(log_fd, buf->records, buf->count * sizeof(call_record));
+    (void)ignored;
+    buf->count = 0;
+}
+
+void release_log(void *arg) {
+    log_buffer *buf = arg;
+    flush_log(buf);
+    munmap(buf->records, LOG_BUFFER * sizeof(call_record));
+    buf->records = NULL;
+}
+
+/* This function maps the segment and resets the heap, and opens the
+ * log if one was asked for. Nothing here may call malloc.
+ */
+void init_preload(void) {
+    long fallback = mygrows != NULL && mygrows() ? GROWING_SEGMENT_MB : DEFAULT_SEGMENT_MB;
+    segment_size = (size_t)env_number("MYHEAP_SIZE", fallback) << 20;
+    void *map = mmap(NULL, segment_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) abort();
+    segment_start = map;
+    long narenas = env_number("MYHEAP_ARENAS", 0);
+    bool ok;
+    if (myinit_anonymous != NULL) { //the segment is private anonymous memory
+        ok = myinit_anonymous(map, segment_size, narenas > 0 ? narenas : 1);
+    } else if (narenas > 0 && myinit_arenas != NULL) {
+        ok = myinit_arenas(map, segment_size, narenas);
+    } else ok = myinit(map, segment_size);
+    if (!ok) abort();
+    if (getenv("MYHEAP_PROFILE") != NULL && myprofile != NULL) {
+        myprofile(env_number("MYHEAP_PROFILE_RATE", DEFAULT_PROFILE_RATE));
+    }
+
+    const char *path = getenv("MYHEAP_TRACE");
+    if (path == NULL || pthread_key_create(&log_key, release_log) != 0) return;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) return;
+    if (write(fd, CALL_LOG_MAGIC, strlen(CALL_LOG_MAGIC)) < 0) {
+        close(fd);
+        return;
+    }
+    log_fd = fd;
+}
+
+/* The process ends without running the main thread's key destructor,
+ * so its buffer is written here, as is the heap profile. Preloaded,
+ * this library is unloaded last and sees nearly every call.
+ */
+__attribute__((destructor)) void finish_log(void) {
+    if (log_fd >= 0 && buffer.records != NULL) flush_log(&buffer);
+    const char *profile = getenv("MYHEAP_PROFILE");
+    if (profile != NULL && myprofile_dump != NULL && segment_start != NULL) myprofile_dump(profile);
+}
+
+/* This function returns the position of a call in the log. A free takes
+ * its number before the block is released and a malloc after it gets
+ * one, so a block reused by another thread is always freed first in
+ * the log.
+ */
+uint64_t log_order(void) {
+    return log_fd >= 0 ? __atomic_fetch_add(&log_seq, 1, __ATOMIC_RELAXED) : 0;
+}
+
+void log_call(uint64_t seq, int type, void *ptr, void *old_ptr, size_t size) {
+    if (log_fd < 0) return;
+    log_buffer *buf = &buffer;
+    if (buf->records == NULL) {
+        void *map = mmap(NULL, LOG_BUFFER * sizeof(call_record), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) return;
+        buf->records = map;
+        pthread_setspecific(log_key, buf);
+    }
+    buf->records[buf->count++] = (call_record){seq, (uintptr_t)ptr, (uintptr_t)old_ptr, size, type};
+    if (buf->count == LOG_BUFFER) flush_log(buf);
+}
+
+//This function tells whether ptr came from our allocator: from the segment, or from memory it mapped itself.
+bool is_ours(void *ptr) {
+    if ((char *)ptr >= segment_start && (char *)ptr < segment_start + segment_size) return true;
+    return mymapped != NULL && mymapped(ptr);
+}
+
+//This function adds an aligned block to the table.
+void put_aligned(aligned_block *entry) {
+    pthread_mutex_lock(&aligned_lock);
+    aligned_block **bucket = &aligned[((uintptr_t)entry->ptr >> 4) % ALIGNED_BUCKETS];
+    entry->nxt = *bucket;
+    *bucket = entry;
+    __atomic_fetch_add(&num_aligned, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&aligned_lock);
+}
+
+/* This function takes ptr out of the table of aligned blocks. Returns
+ * its entry, which the caller frees, or NULL if ptr is an ordinary block.
+ */
+aligned_block *take_aligned(void *ptr) {
+    if (__atomic_load_n(&num_aligned, __ATOMIC_ACQUIRE) == 0) return NULL;
+    pthread_mutex_lock(&aligned_lock);
+    aligned_block **link = &aligned[((uintptr_t)ptr >> 4) % ALIGNED_BUCKETS];
+    while (*link != NULL && (*link)->ptr != ptr) {
+        link = &(*link)->nxt;
+    }
+    aligned_block *entry = *link;
+    if (entry != NULL) {
+        *link = entry->nxt;
+        __atomic_fetch_sub(&num_aligned, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&aligned_lock);
+    return entry;
+}
+
+/* This function allocates size bytes at a multiple of align (a power of
+ * two). An allocator with mymemalign hands out such blocks itself.
+ * Otherwise it only promises ALIGNMENT, so a larger alignment is carved
+ * out of a bigger block and remembered, letting free find the block
+ * again from the address inside it.
+ */
+void *preload_aligned(size_t align, size_t size) {
+    if (align <= ALIGNMENT) return mymalloc(size ? size : 1);
+    if (mymemalign != NULL) return mymemalign(align, size ? size : 1);
+    if (size > MAX_REQUEST_SIZE || align > MAX_REQUEST_SIZE) return NULL;
+    aligned_block *entry = mymalloc(sizeof(aligned_block));
+    void *block = mymalloc(size + align - ALIGNMENT);
+    if (entry == NULL || block == NULL) {
+        myfree(entry);
+        myfree(block);
+        return NULL;
+    }
+    void *ptr = (void *)(((uintptr_t)block + align - 1) & ~(uintptr_t)(align - 1));
+    if (ptr == block) {
+        myfree(entry);
+        return block;
+    }
+    *entry = (aligned_block){ptr, block, size, NULL};
+    put_aligned(entry);
+    return ptr;
+}
+
+/* The functions below replace the C library's. Pointers that are not
+ * ours were handed out before this library took over (by the
+ * dynamic loader, for one) and are left alone.
+ */
+EXPORT void *malloc(size_t size) {
+    pthread_once(&init_once, init_preload);
+    void *ptr = mymalloc(size ? size : 1); //malloc(0) must still return a unique pointer
+    if (ptr == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    log_call(log_order(), OP_MALLOC, ptr, NULL, size);
+    return ptr;
+}
+
+EXPORT void free(void *ptr) {
+    if (ptr == NULL || !is_ours(ptr)) return;
+    log_call(log_order(), OP_FREE, ptr, NULL, 0);
+    aligned_block *entry = take_aligned(ptr);
+    if (entry != NULL) {
+        myfree(entry->block);
+        myfree(entry);
+    } else myfree(ptr);
+}
+
+EXPORT void *realloc(void *old_ptr, size_t new_size) {
+    if (old_ptr == NULL) return malloc(new_size);
+    if (new_size == 0) {
+        free(old_ptr);
+        return NULL;
+    }
+    if (!is_ours(old_ptr)) { //we cannot know how much of it to copy
+        errno = ENOMEM;
+        return NULL;
+    }
+    aligned_block *entry = take_aligned(old_ptr);
+    void *ptr;
+    if (entry != NULL) { //realloc need not keep the alignment, so this becomes an ordinary block
+        ptr = mymalloc(new_size);
+        if (ptr != NULL) {
+            memcpy(ptr, old_ptr, entry->size < new_size ? entry->size : new_size);
+            myfree(entry->block);
+            myfree(entry);
+        } else put_aligned(entry);
+    } else ptr = myrealloc(old_ptr, new_size);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    log_call(log_order(), OP_REALLOC, ptr, old_ptr, new_size);
+    return ptr;
+}
+
+EXPORT void *calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (mycalloc == NULL || count * size == 0) {
+        void *ptr = malloc(count * size);
+        if (ptr != NULL) memset(ptr, 0, count * size);
+        return ptr;
+    }
+    pthread_once(&init_once, init_preload);
+    void *ptr = mycalloc(count, size); //clears only what is not zero already
+    if (ptr == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    log_call(log_order(), OP_MALLOC, ptr, NULL, count * size);
+    return ptr;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t align, size_t size) {
+    if (align < sizeof(void *) || (align & (align - 1)) != 0) return EINVAL;
+    pthread_once(&init_once, init_preload);
+    void *ptr = preload_aligned(align, size);
+    if (ptr == NULL) return ENOMEM;
+    log_call(log_order(), OP_MALLOC, ptr, NULL, size);
+    *memptr = ptr;
+    return 0;
+}
+
+EXPORT void *memalign(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    pthread_once(&init_once, init_preload);
+    void *ptr = preload_aligned(align, size);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    log_call(log_order(), OP_MALLOC, ptr, NULL, size);
+    return ptr;
+}
+
+EXPORT void *aligned_alloc(size_t align, size_t size) {
+    return memalign(align, size);
+}
+
+EXPORT void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
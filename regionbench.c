@@ -0,0 +1,309 @@
+/*
+ * File: regionbench.c
+ * Measures what a request costs when it makes many short-lived objects
+ * and drops them all at its end, three ways: one mymalloc and myfree
+ * per object, a region begun and released per request, and one region
+ * kept for the whole run and reset after every request. The synthetic
+ * handler makes requests of a fixed number of objects of 16 to 512
+ * bytes and writes the first byte of each. Each script given is cut
+ * into requests where none of its blocks is live (every malloc-free
+ * pair of pattern-repeat is one request); in the region replays its
+ * mallocs are cut from the region, its reallocs take a new object and
+ * copy, and its frees do nothing. A region is exactly as big as its
+ * request needs, or the biggest request for the kept one. Each number
+ * is the best of several passes.
+ *
+ * usage: regionbench_explicit [-k objects] [-n requests] [-r repeats] [script...]
+ */
+#include "allocator.h"
+#include "script.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SEGMENT_SIZE ((size_t)1 << 32) //address space only, pages are touched on use
+#define MIN_OBJECT 16
+#define MAX_OBJECT 512
+
+enum { PER_OBJECT, PER_REQUEST, RESET, NUM_MODES };
+
+static const char *mode_names[NUM_MODES] = {"per object", "per request", "reset"};
+
+typedef struct { //a run of script operations after which nothing is live
+    int first;
+    int count;
+    size_t bytes; //room its mallocs and reallocs take in a region
+} request;
+
+typedef struct {
+    void *ptr;
+    size_t size;
+} block;
+
+static void *segment;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//This function rounds size up to what a region takes for it.
+size_t region_bytes(size_t size) {
+    return (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+}
+
+//This function resets the heap before a pass, outside the timed part.
+bool reset_heap(void) {
+    if (!myinit(segment, SEGMENT_SIZE)) {
+        printf("myinit failed.\n");
+        return false;
+    }
+    return true;
+}
+
+/* This function runs the synthetic handler once in the given mode:
+ * num_requests requests, each allocating the k sizes of its row of
+ * sizes and then dropping them. Returns the ns taken, or a negative
+ * number if an allocation failed.
+ */
+double run_handler(int mode, int num_requests, int k, const size_t *sizes, size_t max_bytes) {
+    void **objects = malloc(k * sizeof(void *));
+    region *kept = NULL;
+    if (!reset_heap() || (mode == RESET && (kept = myregion_begin(max_bytes)) == NULL)) {
+        free(objects);
+        return -1;
+    }
+    bool ok = true;
+    double begin = now_ns();
+    for (int req = 0; ok && req < num_requests; req++) {
+        const size_t *row = sizes + (size_t)req * k;
+        region *r = kept;
+        if (mode == PER_REQUEST) {
+            size_t bytes = 0;
+            for (int i = 0; i < k; i++) {
+                bytes += region_bytes(row[i]);
+            }
+            if ((r = myregion_begin(bytes)) == NULL) {
+                ok = false;
+                break;
+            }
+        }
+        int made = 0;
+        for (; made < k; made++) {
+            char *obj = mode == PER_OBJECT ? mymalloc(row[made]) : myregion_alloc(r, row[made]);
+            if (obj == NULL) break;
+            obj[0] = (char)made;
+            objects[made] = obj;
+        }
+        if (mode == PER_OBJECT) {
+            for (int i = 0; i < made; i++) {
+                myfree(objects[i]);
+            }
+        } else if (mode == PER_REQUEST) {
+            myregion_release(r);
+        } else myregion_reset(r, NULL);
+        ok = made == k;
+    }
+    if (kept != NULL) myregion_release(kept);
+    double elapsed = now_ns() - begin;
+    free(objects);
+    return ok ? elapsed : -1;
+}
+
+/* This function splits s into requests at the operations after which
+ * no block is live, and stores them in requests. Returns how many
+ * there are.
+ */
+int find_requests(script *s, request *requests) {
+    bool *live = calloc(s->num_ids + 1, sizeof(bool));
+    int num_requests = 0, num_live = 0;
+    request *cur = NULL;
+    for (int i = 0; i < s->num_ops; i++) {
+        script_op *op = &s->ops[i];
+        int id = OP_ID(op);
+        if (cur == NULL) {
+            cur = &requests[num_requests++];
+            *cur = (request){i, 0, 0};
+        }
+        cur->count++;
+        if (OP_TYPE(op) == OP_FREE) {
+            num_live -= live[id];
+            live[id] = false;
+        } else {
+            cur->bytes += region_bytes(op->size);
+            num_live += !live[id] && op->size != 0;
+            num_live -= live[id] && op->size == 0;
+            live[id] = op->size != 0;
+        }
+        if (num_live == 0) cur = NULL;
+    }
+    free(live);
+    return num_requests;
+}
+
+/* This function replays s once in the given mode, a request at a time.
+ * Returns the ns taken, or a negative number if an allocation failed.
+ */
+double replay(script *s, block *blocks, request *requests, int num_requests, int mode, size_t max_bytes) {
+    memset(blocks, 0, s->num_ids * sizeof(block));
+    region *kept = NULL;
+    if (!reset_heap() || (mode == RESET && (kept = myregion_begin(max_bytes)) == NULL)) return -1;
+    bool ok = true;
+    double begin = now_ns();
+    for (int req = 0; ok && req < num_requests; req++) {
+        request *rq = &requests[req];
+        region *r = kept;
+        if (mode == PER_REQUEST && (r = myregion_begin(rq->bytes)) == NULL) {
+            ok = false;
+            break;
+        }
+        for (int i = rq->first; i < rq->first + rq->count; i++) {
+            script_op *op = &s->ops[i];
+            block *b = &blocks[OP_ID(op)];
+            int type = OP_TYPE(op);
+            if (type == OP_FREE) {
+                if (mode == PER_OBJECT) myfree(b->ptr);
+                b->ptr = NULL;
+                continue;
+            }
+            void *ptr;
+            if (mode == PER_OBJECT) {
+                ptr = type == OP_MALLOC ? mymalloc(op->size) : myrealloc(b->ptr, op->size);
+            } else {
+                ptr = myregion_alloc(r, op->size);
+                if (ptr != NULL && type == OP_REALLOC && b->ptr != NULL) {
+                    memcpy(ptr, b->ptr, b->size < op->size ? b->size : op->size);
+                }
+            }
+            if (ptr == NULL && op->size != 0) {
+                printf("Operation %d (%u bytes) failed.\n", i, op->size);
+                ok = false;
+                break;
+            }
+            b->ptr = ptr;
+            b->size = op->size;
+        }
+        if (mode == PER_REQUEST) {
+            myregion_release(r);
+        } else if (mode == RESET) myregion_reset(r, NULL);
+    }
+    if (kept != NULL) myregion_release(kept);
+    double elapsed = now_ns() - begin;
+    if (mode == PER_OBJECT) { //what the last request left
+        for (int id = 0; id < s->num_ids; id++) {
+            myfree(blocks[id].ptr);
+        }
+    }
+    return ok ? elapsed : -1;
+}
+
+//This function prints the best time of each mode per request and per object.
+void print_modes(double best[NUM_MODES], int num_requests, long num_objects) {
+    for (int mode = 0; mode < NUM_MODES; mode++) {
+        printf("  %-12s %9.1f ns per request, %6.1f per object\n", mode_names[mode],
+               best[mode] / num_requests, best[mode] / num_objects);
+    }
+}
+
+/* This function benchmarks the synthetic handler in every mode.
+ * Returns false if an allocation failed.
+ */
+bool bench_handler(int num_requests, int k, int repeats) {
+    size_t *sizes = malloc((size_t)num_requests * k * sizeof(size_t));
+    unsigned long rng = 1;
+    size_t max_bytes = 0;
+    for (int req = 0; req < num_requests; req++) {
+        size_t bytes = 0;
+        for (int i = 0; i < k; i++) {
+            rng = rng * 6364136223846793005UL + 1442695040888963407UL;
+            size_t size = MIN_OBJECT + (rng >> 33) % (MAX_OBJECT - MIN_OBJECT + 1);
+            sizes[(size_t)req * k + i] = size;
+            bytes += region_bytes(size);
+        }
+        if (bytes > max_bytes) max_bytes = bytes;
+    }
+    double best[NUM_MODES];
+    bool ok = true;
+    for (int rep = 0; ok && rep <= repeats; rep++) { //the first pass touches the pages the later ones reuse
+        for (int mode = 0; ok && mode < NUM_MODES; mode++) {
+            double ns = run_handler(mode, num_requests, k, sizes, max_bytes);
+            ok = ns >= 0;
+            if (rep == 1 || (rep > 1 && ns < best[mode])) best[mode] = ns;
+        }
+    }
+    if (ok) {
+        printf("handler: %d requests of %d objects of %d to %d bytes\n", num_requests, k, MIN_OBJECT, MAX_OBJECT);
+        print_modes(best, num_requests, (long)num_requests * k);
+    } else printf("The handler ran out of memory.\n");
+    free(sizes);
+    return ok;
+}
+
+/* This function benchmarks one script in every mode. Returns false if
+ * it could not be read or replayed.
+ */
+bool bench_script(const char *path, int repeats) {
+    script s;
+    if (!read_script(path, &s)) return false;
+    block *blocks = malloc((s.num_ids + 1) * sizeof(block));
+    request *requests = malloc((s.num_ops + 1) * sizeof(request));
+    int num_requests = find_requests(&s, requests);
+    size_t max_bytes = 0;
+    long num_objects = 0;
+    for (int req = 0; req < num_requests; req++) {
+        if (requests[req].bytes > max_bytes) max_bytes = requests[req].bytes;
+    }
+    for (int i = 0; i < s.num_ops; i++) {
+        num_objects += OP_TYPE(&s.ops[i]) != OP_FREE;
+    }
+    double best[NUM_MODES];
+    bool ok = num_requests > 0 && max_bytes > 0;
+    for (int rep = 0; ok && rep <= repeats; rep++) {
+        for (int mode = 0; ok && mode < NUM_MODES; mode++) {
+            double ns = replay(&s, blocks, requests, num_requests, mode, max_bytes);
+            ok = ns >= 0;
+            if (rep == 1 || (rep > 1 && ns < best[mode])) best[mode] = ns;
+        }
+    }
+    if (ok) {
+        printf("%s: %d requests of %.1f objects on average, the biggest taking %zu bytes\n", path,
+               num_requests, (double)num_objects / num_requests, max_bytes);
+        print_modes(best, num_requests, num_objects);
+    } else printf("%s could not be replayed.\n", path);
+    free(requests);
+    free(blocks);
+    free_script(&s);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    int k = 64, num_requests = 10000, repeats = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "k:n:r:")) != -1) {
+        if (opt == 'k') k = atoi(optarg);
+        else if (opt == 'n') num_requests = atoi(optarg);
+        else if (opt == 'r') repeats = atoi(optarg);
+        else break;
+    }
+    if (k < 1 || num_requests < 1 || repeats < 1) {
+        printf("usage: %s [-k objects] [-n requests] [-r repeats] [script...]\n", argv[0]);
+        return 1;
+    }
+    segment = mmap(NULL, SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (segment == MAP_FAILED) {
+        printf("Could not map the heap segment.\n");
+        return 1;
+    }
+
+    int status = bench_handler(num_requests, k, repeats) ? 0 : 1;
+    for (int i = optind; i < argc; i++) {
+        if (!bench_script(argv[i], repeats)) status = 1;
+    }
+    munmap(segment, SEGMENT_SIZE);
+    return status;
+}
@@ -0,0 +1,145 @@
+/*
+ * File: script.c
+ * Reads allocator test scripts into an array of operations, either by
+ * parsing the text format or by mapping a binary trace.
+ */
+#include "script.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* This function points s at the operations of a binary trace that is
+ * already mapped, after checking that the header describes the file
+ * and, in one pass over the records where they lie, that every record
+ * has a known type and an id no larger than the header's and that the
+ * header counts them right, as the replays index their block tables by
+ * those ids.
+ */
+bool load_trace(const char *path, void *map, size_t map_size, script *s) {
+    trace_header *hdr = map;
+    if (hdr->version != TRACE_VERSION || hdr->num_ops > (uint64_t)INT32_MAX ||
+        hdr->max_id > MAX_SCRIPT_ID ||
+        map_size != sizeof(trace_header) + hdr->num_ops * sizeof(script_op)) {
+        printf("%s: trace header does not match the file.\n", path);
+        return false;
+    }
+    script_op *ops = (script_op *)(hdr + 1);
+    uint64_t counts[NUM_OP_TYPES] = {0};
+    for (uint64_t i = 0; i < hdr->num_ops; i++) {
+        uint32_t type = OP_TYPE(&ops[i]);
+        if (type >= NUM_OP_TYPES || OP_ID(&ops[i]) > hdr->max_id) {
+            printf("%s: trace record %lu is malformed.\n", path, (unsigned long)i);
+            return false;
+        }
+        counts[type]++;
+    }
+    if (memcmp(counts, hdr->counts, sizeof(counts)) != 0) {
+        printf("%s: trace header counts do not match the records.\n", path);
+        return false;
+    }
+    s->ops = ops;
+    s->num_ops = hdr->num_ops;
+    s->num_ids = hdr->max_id + 1;
+    for (int type = 0; type < NUM_OP_TYPES; type++) {
+        s->counts[type] = hdr->counts[type];
+    }
+    s->map = map;
+    s->map_size = map_size;
+    return true;
+}
+
+//This function parses the text format from fp into s.
+bool parse_script(const char *path, FILE *fp, script *s) {
+    int capacity = 1024;
+    s->ops = malloc(capacity * sizeof(script_op));
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\0') continue;
+
+        char op = 0;
+        long id = -1;
+        unsigned long size = 0;
+        int fields = sscanf(start, "%c %ld %lu", &op, &id, &size);
+        int type = op == 'a' ? OP_MALLOC : op == 'r' ? OP_REALLOC : op == 'f' ? OP_FREE : -1;
+        bool ok = (type == OP_FREE && fields >= 2) || (type >= 0 && type != OP_FREE && fields == 3);
+        if (!ok || id < 0 || id > MAX_SCRIPT_ID || size > UINT32_MAX) {
+            printf("%s:%d: malformed line.\n", path, lineno);
+            return false;
+        }
+        if (s->num_ops == capacity) {
+            capacity *= 2;
+            s->ops = realloc(s->ops, capacity * sizeof(script_op));
+        }
+        s->ops[s->num_ops].op_id = ((uint32_t)type << OP_SHIFT) | id;
+        s->ops[s->num_ops].size = type == OP_FREE ? 0 : size;
+        s->num_ops++;
+        s->counts[type]++;
+        if (id >= s->num_ids) s->num_ids = id + 1;
+    }
+    return true;
+}
+
+bool read_script(const char *path, script *s) {
+    memset(s, 0, sizeof(*s));
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        printf("Could not open script %s.\n", path);
+        return false;
+    }
+    char magic[sizeof(((trace_header *)0)->magic)];
+    bool binary = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+                  memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0;
+    bool ok;
+    if (binary) {
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fstat(fileno(fp), &st) == 0 && (size_t)st.st_size >= sizeof(trace_header)) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        }
+        ok = map != MAP_FAILED && load_trace(path, map, st.st_size, s);
+        if (map == MAP_FAILED) {
+            printf("Could not map trace %s.\n", path);
+        } else if (!ok) munmap(map, st.st_size);
+    } else {
+        rewind(fp);
+        ok = parse_script(path, fp, s);
+    }
+    fclose(fp);
+    if (!ok) free_script(s);
+    return ok;
+}
+
+bool write_trace(const char *path, const script *s) {
+    trace_header hdr = {0};
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.max_id = s->num_ids > 0 ? s->num_ids - 1 : 0;
+    hdr.num_ops = s->num_ops;
+    for (int type = 0; type < NUM_OP_TYPES; type++) {
+        hdr.counts[type] = s->counts[type];
+    }
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        printf("Could not create trace %s.\n", path);
+        return false;
+    }
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+              fwrite(s->ops, sizeof(script_op), s->num_ops, fp) == (size_t)s->num_ops;
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) printf("Could not write trace %s.\n", path);
+    return ok;
+}
+
+void free_script(script *s) {
+    if (s->map != NULL) {
+        munmap(s->map, s->map_size);
+    } else free(s->ops);
+    memset(s, 0, sizeof(*s));
+}
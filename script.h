@@ -0,0 +1,92 @@
+/* File: script.h
+ * --------------
+ * Reads the allocator test scripts in samples/ into memory so that
+ * tools other than the test harness can replay them. A script is
+ * either the text format (one "a id size", "r id size" or "f id" per
+ * line) or the binary trace format below, which is mapped straight
+ * from the file with nothing to parse.
+ */
+#ifndef _SCRIPT_H
+#define _SCRIPT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum { OP_MALLOC, OP_REALLOC, OP_FREE, NUM_OP_TYPES };
+
+/* One operation, 8 bytes, laid out the same in memory and in a trace
+ * file: the operation in the top two bits of op_id, the block id in
+ * the rest, and the requested size (0 for a free).
+ */
+typedef struct {
+    uint32_t op_id;
+    uint32_t size;
+} script_op;
+
+#define OP_SHIFT 30
+#define MAX_SCRIPT_ID ((1u << OP_SHIFT) - 1)
+#define OP_TYPE(op) ((op)->op_id >> OP_SHIFT)
+#define OP_ID(op) ((op)->op_id & MAX_SCRIPT_ID)
+
+/* A binary trace is this header followed by num_ops script_ops, all
+ * in the byte order of the machine that wrote it.
+ */
+#define TRACE_MAGIC "MYHEAPTR"
+#define TRACE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t max_id;
+    uint64_t num_ops;
+    uint64_t counts[NUM_OP_TYPES]; //operations of each type
+} trace_header;
+
+/* The preload library (preload.c) logs calls in this form, because it
+ * only sees addresses: convert_trace sorts the records by seq and
+ * turns the addresses into block ids. A log is CALL_LOG_MAGIC followed
+ * by the records of every thread, each thread's written a buffer at a
+ * time.
+ */
+#define CALL_LOG_MAGIC "MYHEAPLG"
+
+typedef struct {
+    uint64_t seq; //order of the call among all threads
+    uint64_t ptr; //block returned, or freed
+    uint64_t old_ptr; //block passed to realloc
+    uint32_t size;
+    uint32_t type; //OP_MALLOC, OP_REALLOC or OP_FREE
+} call_record;
+
+typedef struct {
+    script_op *ops;
+    int num_ops;
+    int num_ids; //ids run from 0 to num_ids - 1
+    int counts[NUM_OP_TYPES];
+    void *map; //the mapped trace file, or NULL if ops were parsed from text
+    size_t map_size;
+} script;
+
+/* Function: read_script
+ * ---------------------
+ * Loads the script or trace at path into s. Text lines that are blank
+ * or start with '#' are skipped. Returns false, after printing why, if
+ * the file cannot be read, a line is malformed or a trace is truncated.
+ */
+bool read_script(const char *path, script *s);
+
+/* Function: write_trace
+ * ---------------------
+ * Writes s to path in the binary trace format. Returns false, after
+ * printing why, if the file cannot be written.
+ */
+bool write_trace(const char *path, const script *s);
+
+/* Function: free_script
+ * ---------------------
+ * Releases the memory held by a script filled in by read_script.
+ */
+void free_script(script *s);
+
+#endif
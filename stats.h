@@ -0,0 +1,40 @@
+/* File: stats.h
+ * -------------
+ * Helpers the allocators use to keep the heap_stats counters (see
+ * allocator.h). With HEAP_STATS undefined every STAT() compiles to
+ * nothing, so the counting costs nothing unless it is asked for.
+ */
+#ifndef _STATS_H
+#define _STATS_H
+
+#include "allocator.h"
+
+#ifdef HEAP_STATS
+#define STAT(statement) do { statement; } while (0)
+#define STATS_ENABLED true
+#else
+#define STAT(statement) do { } while (0)
+#define STATS_ENABLED false
+#endif
+
+//This function returns the size_hist class of a request for size bytes.
+static inline int stats_class(size_t size) {
+    int cls = size <= 8 ? 0 : 61 - __builtin_clzl(size - 1);
+    return cls < STATS_SIZE_CLASSES ? cls : STATS_SIZE_CLASSES - 1;
+}
+
+/* This function counts one call in stats: the call itself in counter,
+ * the size of its request if it has one and whether it failed.
+ */
+static inline void stats_count(heap_stats *stats, unsigned long *counter, size_t size, bool failed) {
+    (*counter)++;
+    if (size != 0) stats->size_hist[stats_class(size)]++;
+    if (failed) stats->failed++;
+}
+
+//This function records a new high of payload bytes in use.
+static inline void stats_note_in_use(heap_stats *stats, size_t bytes_in_use) {
+    if (bytes_in_use > stats->peak_bytes_in_use) stats->peak_bytes_in_use = bytes_in_use;
+}
+
+#endif
@@ -0,0 +1,369 @@
+/*
+ * File: stressbench.c
+ * Runs classic multithreaded allocator workloads against one shared
+ * heap on 1 to N threads and prints, for each thread count, the
+ * mallocs and frees per second, the speedup and parallel efficiency
+ * over one thread, and the peak footprint: how far the resident memory
+ * of the process rose above where it stood when the run began. Every
+ * thread does the same amount of work whatever the thread count. The
+ * workloads are:
+ *   larson    each thread replaces random objects of 16 to 128 bytes in
+ *             an array of its own, and after every round hands the
+ *             array to the next thread, which frees what it inherited
+ *             (after Larson and Krishnan's server benchmark)
+ *   pipeline  the threads form a ring: each allocates messages of 16 to
+ *             1024 bytes for the next thread and frees the ones the
+ *             thread before it sends, so every free is of a block
+ *             another thread allocated
+ *   churn     each thread allocates and frees objects of 8 to 512 bytes
+ *             in a working set of its own, never sharing one
+ *   server    each thread serves requests that allocate small, medium
+ *             and now and then large buffers and free them at the end,
+ *             and replace one of a set of long-lived session objects
+ * The heap is reset with myinit before every run and checked with
+ * validate_heap after it.
+ *
+ * usage: stressbench_<allocator> [-t max_threads] [-n ops] [-s workload]
+ */
+#include "allocator.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HEAP_PER_THREAD ((size_t)1 << 30) //address space only, pages are touched on use
+#define MAX_THREADS 64
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 10
+#define RING_SIZE 256 //messages in flight from one thread to the next
+#define CHURN_SLOTS 256
+#define SESSION_SLOTS 64
+#define REQUEST_SMALL 20 //small buffers per request
+#define REQUEST_MEDIUM 2
+#define LARGE_EVERY 50 //requests per large buffer, on average
+
+typedef struct worker worker;
+
+typedef struct {
+    const char *name;
+    void (*run)(worker *w);
+} workload;
+
+typedef struct { //messages one thread sends the next, emptied only by the next one
+    void *slots[RING_SIZE];
+    unsigned long head;
+    unsigned long tail;
+} __attribute__((aligned(64))) ring;
+
+struct worker {
+    int id;
+    int nthreads;
+    long ops; //mallocs and frees this thread is to make, and then made
+    unsigned long rng;
+    pthread_barrier_t *start;
+    pthread_barrier_t *round; //between larson rounds, once every array is done with
+    void ***larson_slots; //every thread's larson array, indexed by thread
+    ring *rings; //ring i carries thread i's messages to thread i + 1
+    double begin, end;
+    bool failed;
+} __attribute__((aligned(64)));
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//This function returns the next number from a thread's own generator.
+unsigned long next_random(worker *w) {
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+//This function returns a random size from min to max bytes.
+size_t random_size(worker *w, size_t min, size_t max) {
+    return min + next_random(w) % (max - min + 1);
+}
+
+//This function allocates size bytes and touches them like a client would.
+void *alloc_touched(worker *w, size_t size) {
+    char *ptr = mymalloc(size);
+    if (ptr == NULL) {
+        w->failed = true;
+        return NULL;
+    }
+    ptr[0] = (char)size;
+    ptr[size - 1] = (char)size;
+    return ptr;
+}
+
+/* This function reads the process's resident memory in KB, or with
+ * peak its high-water mark since the last reset_peak.
+ */
+long resident_kb(bool peak) {
+    const char *key = peak ? "VmHWM:" : "VmRSS:";
+    char line[256];
+    long kb = 0;
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (fp == NULL) return 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, key, strlen(key)) == 0) sscanf(line + strlen(key), "%ld", &kb);
+    }
+    fclose(fp);
+    return kb;
+}
+
+//This function sets the resident high-water mark back to what is resident now.
+void reset_peak(void) {
+    FILE *fp = fopen("/proc/self/clear_refs", "w");
+    if (fp == NULL) return;
+    fputs("5", fp);
+    fclose(fp);
+}
+
+void run_larson(worker *w) {
+    void **mine = w->larson_slots[w->id];
+    long per_round = w->ops / 2 / LARSON_ROUNDS; //a free and a malloc per replacement
+    long made = 0;
+    for (int i = 0; i < LARSON_SLOTS; i++) {
+        mine[i] = alloc_touched(w, random_size(w, 16, 128));
+    }
+    made += LARSON_SLOTS;
+    for (int round = 0; round < LARSON_ROUNDS; round++) {
+        for (long i = 0; i < per_round; i++) {
+            int slot = next_random(w) % LARSON_SLOTS;
+            myfree(mine[slot]);
+            mine[slot] = alloc_touched(w, random_size(w, 16, 128));
+        }
+        made += 2 * per_round;
+        //every thread passes its array on at once, so the next round frees another thread's objects
+        pthread_barrier_wait(w->round);
+        mine = w->larson_slots[(w->id + round + 1) % w->nthreads];
+    }
+    for (int i = 0; i < LARSON_SLOTS; i++) {
+        myfree(mine[i]);
+    }
+    w->ops = made + LARSON_SLOTS;
+}
+
+/* Each thread sends w->ops / 2 messages and frees as many from the
+ * thread before it. A thread whose outgoing ring is full frees what is
+ * waiting for it meanwhile, which is always possible: if every ring
+ * were full, every thread would have messages waiting.
+ */
+void run_pipeline(worker *w) {
+    ring *out = &w->rings[w->id];
+    ring *in = &w->rings[(w->id + w->nthreads - 1) % w->nthreads];
+    long messages = w->ops / 2, sent = 0, received = 0;
+    while (sent < messages || received < messages) {
+        bool moved = false;
+        if (sent < messages && out->tail - __atomic_load_n(&out->head, __ATOMIC_ACQUIRE) < RING_SIZE) {
+            void *msg = alloc_touched(w, random_size(w, 16, 1024));
+            out->slots[out->tail % RING_SIZE] = msg;
+            __atomic_store_n(&out->tail, out->tail + 1, __ATOMIC_RELEASE);
+            sent++;
+            moved = true;
+        }
+        unsigned long tail = __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE);
+        if (tail != in->head) {
+            for (unsigned long i = in->head; i < tail; i++) {
+                myfree(in->slots[i % RING_SIZE]);
+            }
+            received += tail - in->head;
+            __atomic_store_n(&in->head, tail, __ATOMIC_RELEASE);
+            moved = true;
+        }
+        if (!moved) sched_yield(); //let the threads at either end catch up
+    }
+    w->ops = sent + received;
+}
+
+void run_churn(worker *w) {
+    void *slots[CHURN_SLOTS] = {NULL};
+    long made = 0;
+    while (made < w->ops && !w->failed) {
+        int slot = next_random(w) % CHURN_SLOTS;
+        if (slots[slot] != NULL) {
+            myfree(slots[slot]);
+            slots[slot] = NULL;
+        } else slots[slot] = alloc_touched(w, random_size(w, 8, 512));
+        made++;
+    }
+    for (int i = 0; i < CHURN_SLOTS; i++) {
+        if (slots[i] != NULL) made++;
+        myfree(slots[i]);
+    }
+    w->ops = made;
+}
+
+void run_server(worker *w) {
+    void *sessions[SESSION_SLOTS];
+    void *buffers[REQUEST_SMALL + REQUEST_MEDIUM + 1];
+    for (int i = 0; i < SESSION_SLOTS; i++) {
+        sessions[i] = alloc_touched(w, random_size(w, 64, 4096));
+    }
+    long made = SESSION_SLOTS;
+    while (made < w->ops && !w->failed) {
+        int n = 0;
+        for (int i = 0; i < REQUEST_SMALL; i++) {
+            buffers[n++] = alloc_touched(w, random_size(w, 16, 256));
+        }
+        for (int i = 0; i < REQUEST_MEDIUM; i++) {
+            buffers[n++] = alloc_touched(w, random_size(w, 1024, 16384));
+        }
+        if (next_random(w) % LARGE_EVERY == 0) buffers[n++] = alloc_touched(w, random_size(w, 65536, 1 << 20));
+        int slot = next_random(w) % SESSION_SLOTS;
+        myfree(sessions[slot]);
+        sessions[slot] = alloc_touched(w, random_size(w, 64, 4096));
+        while (n > 0) {
+            myfree(buffers[--n]);
+            made += 2;
+        }
+        made += 2;
+    }
+    for (int i = 0; i < SESSION_SLOTS; i++) {
+        myfree(sessions[i]);
+    }
+    w->ops = made + SESSION_SLOTS;
+}
+
+static const workload workloads[] = {
+    {"larson", run_larson},
+    {"pipeline", run_pipeline},
+    {"churn", run_churn},
+    {"server", run_server},
+};
+#define NUM_WORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+static const workload *current;
+static worker workers[MAX_THREADS];
+static ring rings[MAX_THREADS];
+
+void *run_worker(void *arg) {
+    worker *w = arg;
+    pthread_barrier_wait(w->start);
+    w->begin = now_sec();
+    current->run(w);
+    w->end = now_sec();
+    return NULL;
+}
+
+/* This function runs the current workload on nthreads threads, each
+ * making about ops mallocs and frees, on a freshly reset heap. It
+ * stores the operations per second and the peak footprint in KB.
+ * Returns false if an allocation failed or the heap ended up invalid.
+ */
+bool measure(void *segment, int nthreads, long ops, double *throughput, long *peak_kb) {
+    madvise(segment, HEAP_PER_THREAD * nthreads, MADV_DONTNEED); //start from nothing resident
+    if (!myinit(segment, HEAP_PER_THREAD * nthreads)) {
+        printf("myinit failed for %d threads.\n", nthreads);
+        return false;
+    }
+    pthread_barrier_t start, round;
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    pthread_barrier_init(&round, NULL, nthreads);
+    void **larson_slots[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    memset(rings, 0, nthreads * sizeof(ring));
+    for (int t = 0; t < nthreads; t++) {
+        larson_slots[t] = malloc(LARSON_SLOTS * sizeof(void *));
+    }
+    long start_kb = resident_kb(false);
+    reset_peak();
+    for (int t = 0; t < nthreads; t++) {
+        workers[t] = (worker){t, nthreads, ops, 0x9e3779b97f4a7c15UL * (t + 1), &start, &round, larson_slots,
+                              rings, 0, 0, false};
+        pthread_create(&tids[t], NULL, run_worker, &workers[t]);
+    }
+    pthread_barrier_wait(&start);
+    long total = 0;
+    bool failed = false;
+    double begin = 0, end = 0;
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(tids[t], NULL);
+        total += workers[t].ops;
+        failed |= workers[t].failed;
+        if (t == 0 || workers[t].begin < begin) begin = workers[t].begin;
+        if (workers[t].end > end) end = workers[t].end;
+    }
+    long peak = resident_kb(true);
+    *peak_kb = peak > start_kb ? peak - start_kb : 0; //the C library may hand back pages it held
+    pthread_barrier_destroy(&start);
+    pthread_barrier_destroy(&round);
+    for (int t = 0; t < nthreads; t++) {
+        free(larson_slots[t]);
+    }
+
+    if (failed) {
+        printf("Allocation failed with %d threads.\n", nthreads);
+        return false;
+    }
+    if (!validate_heap()) {
+        printf("Heap is inconsistent after %d threads.\n", nthreads);
+        return false;
+    }
+    *throughput = total / (end - begin);
+    return true;
+}
+
+/* This function prints the table of the current workload for 1 to
+ * max_threads threads. Returns false if a run failed.
+ */
+bool run_workload(void *segment, int max_threads, long ops) {
+    double throughput, base = 0;
+    long peak_kb;
+    //one untimed run so the single-thread row does not pay for first-touch page faults
+    if (!measure(segment, 1, ops, &throughput, &peak_kb)) return false;
+
+    printf("%s\n%7s %12s %8s %10s %9s\n", current->name, "threads", "Mops/s", "speedup", "efficiency", "peak MB");
+    for (int nthreads = 1; nthreads <= max_threads; nthreads++) {
+        if (!measure(segment, nthreads, ops, &throughput, &peak_kb)) return false;
+        if (nthreads == 1) base = throughput;
+        double speedup = throughput / base;
+        printf("%7d %12.2f %8.2f %9.0f%% %9.1f\n", nthreads, throughput / 1e6, speedup,
+               100 * speedup / nthreads, peak_kb / 1024.0);
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    long ops = 400000;
+    const char *only = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:s:")) != -1) {
+        if (opt == 't') max_threads = atoi(optarg);
+        else if (opt == 'n') ops = atol(optarg);
+        else if (opt == 's') only = optarg;
+        else break;
+    }
+    bool known = only == NULL;
+    for (int i = 0; i < NUM_WORKLOADS; i++) {
+        known |= only != NULL && strcmp(only, workloads[i].name) == 0;
+    }
+    if (optind < argc || max_threads < 1 || max_threads > MAX_THREADS || ops < 2 * LARSON_SLOTS || !known) {
+        printf("usage: %s [-t max_threads] [-n ops] [-s larson|pipeline|churn|server]\n", argv[0]);
+        return 1;
+    }
+    void *segment = mmap(NULL, HEAP_PER_THREAD * max_threads, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (segment == MAP_FAILED) {
+        printf("Could not map a %zu MB heap.\n", (HEAP_PER_THREAD * max_threads) >> 20);
+        return 1;
+    }
+
+    int status = 0;
+    for (int i = 0; i < NUM_WORKLOADS && status == 0; i++) {
+        current = &workloads[i];
+        if (only != NULL && strcmp(only, current->name) != 0) continue;
+        if (!run_workload(segment, max_threads, ops)) status = 1;
+    }
+    munmap(segment, HEAP_PER_THREAD * max_threads);
+    return status;
+}
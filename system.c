@@ -0,0 +1,44 @@
+/*
+ * File: system.c
+ * The allocator.h interface on top of the C library's malloc, so the
+ * benchmarks can compare our allocators with it. The segment passed to
+ * myinit is ignored.
+ */
+#include "allocator.h"
+#include <stdlib.h>
+#include <string.h>
+
+bool myinit(void *heap_start, size_t heap_size) {
+    return true;
+}
+
+void *mymalloc(size_t requested_size) {
+    if (requested_size == 0 || requested_size > MAX_REQUEST_SIZE) return NULL;
+    return malloc(requested_size);
+}
+
+void myfree(void *ptr) {
+    free(ptr);
+}
+
+void *myrealloc(void *old_ptr, size_t new_size) {
+    if (new_size == 0) {
+        free(old_ptr);
+        return NULL;
+    }
+    if (new_size > MAX_REQUEST_SIZE) return NULL;
+    return realloc(old_ptr, new_size);
+}
+
+bool validate_heap() {
+    return true;
+}
+
+void dump_heap() {
+}
+
+//The C library keeps its own counts, so there is nothing to report.
+bool mystats(heap_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    return false;
+}
@@ -0,0 +1,494 @@
+/*
+ * File: tlsf.c
+ * This program implements a two-level segregated fit (TLSF) heap
+ * manager. Free blocks are indexed by a first level (power of two
+ * of the size) and a second level (SL_COUNT linear steps inside that
+ * power of two), each with a bitmap of non-empty lists. mymalloc and
+ * myfree do a constant amount of work no matter how many blocks the
+ * heap holds: no list is ever walked.
+ */
+#include "allocator.h"
+#include "debug_break.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define HEADER_SIZE 8 //bytes
+#define FOOTER_SIZE 8 //free blocks only
+#define USED_BIT 0x1
+#define PREV_FREE 0x2 //block right before this one is free
+#define PREV_MIN 0x4 //block right before this one is a free block of MIN_PAYLOAD bytes
+#define FLAG_BITS 0x7
+
+#define SL_LOG2 4 //second level splits each power of two into 16 lists
+#define SL_COUNT (1 << SL_LOG2)
+#define FL_SHIFT (SL_LOG2 + 3) //sizes below 128 are all in first level 0
+#define SMALL_BLOCK (1UL << FL_SHIFT)
+#define FL_COUNT (64 - FL_SHIFT + 1)
+
+typedef struct listnode { //this stores prev and next pointers for freelist
+    struct listnode *prev;
+    struct listnode *nxt;
+} listnode;
+
+typedef struct {
+    unsigned long size; //payload bytes and flag bits
+} header;
+
+#define MIN_PAYLOAD sizeof(listnode) //free blocks this small have no footer
+#define MIN_BLOCK (HEADER_SIZE + MIN_PAYLOAD) //smallest block we can split off
+
+static size_t segment_size;
+static void *segment_start;
+static void *segment_end;
+
+static listnode *lists[FL_COUNT][SL_COUNT];
+static unsigned long fl_map; //bit f is set iff sl_map[f] != 0
+static unsigned int sl_map[FL_COUNT]; //bit s is set iff lists[f][s] is non-empty
+static size_t nbytes_inuse;
+static int num_header;
+static size_t nused; //furthest into the segment a block has reached
+static heap_stats stats; //counters of mystats (HEAP_STATS only)
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER; //guards everything above
+
+bool check_heap(void);
+
+/*
+ * This function rounds up the size requested to the given multiple
+ * (must be a power of 2) and returns the result.
+ */
+size_t addpad(size_t size, size_t mult) {
+    return (size + mult - 1) & ~(mult - 1);
+}
+
+size_t get_size(header *hdr) {
+    return hdr->size & ~(unsigned long)FLAG_BITS;
+}
+
+bool is_used(header *hdr) {
+    return hdr->size & USED_BIT;
+}
+
+header *next_header(header *hdr) {
+    return (header *)((char *)hdr + HEADER_SIZE + get_size(hdr));
+}
+
+//This function uses the footer (or PREV_MIN) of the free block before hdr.
+header *prev_header(header *hdr) {
+    if (hdr->size & PREV_MIN) return (header *)((char *)hdr - MIN_BLOCK);
+    unsigned long prev_size = *(unsigned long *)((char *)hdr - FOOTER_SIZE);
+    return (header *)((char *)hdr - prev_size - HEADER_SIZE);
+}
+
+header *node_to_header(listnode *node) {
+    return (header *)((char *)node - HEADER_SIZE);
+}
+
+listnode *header_to_node(header *hdr) {
+    return (listnode *)((char *)hdr + HEADER_SIZE);
+}
+
+/* This function maps a size to its first and second level index.
+ * Below SMALL_BLOCK the second level is simply size / 8.
+ */
+void mapping(size_t size, int *fl, int *sl) {
+    if (size < SMALL_BLOCK) {
+        *fl = 0;
+        *sl = size >> 3;
+    } else {
+        int log2 = 63 - __builtin_clzl(size);
+        *fl = log2 - FL_SHIFT + 1;
+        *sl = (size >> (log2 - SL_LOG2)) ^ SL_COUNT;
+    }
+}
+
+/* This function finds the first non-empty list whose blocks are all
+ * at least size bytes. The size is rounded up to the next list
+ * boundary first, so whatever block sits at the head fits without
+ * looking at it. Returns NULL if there is no such block.
+ */
+header *find_suitable(size_t size) {
+    STAT(stats.searches++);
+    if (size >= SMALL_BLOCK) {
+        size += (1UL << (63 - __builtin_clzl(size) - SL_LOG2)) - 1;
+    }
+    int fl, sl;
+    mapping(size, &fl, &sl);
+    if (fl >= FL_COUNT) return NULL;
+
+    unsigned int sl_avail = sl_map[fl] & (~0U << sl);
+    if (sl_avail == 0) {
+        unsigned long fl_avail = fl + 1 < FL_COUNT ? fl_map & (~0UL << (fl + 1)) : 0;
+        if (fl_avail == 0) return NULL;
+        fl = __builtin_ctzl(fl_avail);
+        sl_avail = sl_map[fl];
+    }
+    sl = __builtin_ctz(sl_avail);
+    STAT(stats.search_steps++);
+    return node_to_header(lists[fl][sl]);
+}
+
+//This function pushes a free block onto the front of its list.
+void insert_block(header *hdr) {
+    int fl, sl;
+    mapping(get_size(hdr), &fl, &sl);
+    listnode *node = header_to_node(hdr);
+    node->prev = NULL;
+    node->nxt = lists[fl][sl];
+    if (node->nxt != NULL) node->nxt->prev = node;
+    lists[fl][sl] = node;
+    sl_map[fl] |= 1U << sl;
+    fl_map |= 1UL << fl;
+}
+
+//This function takes a free block off its list and clears empty bitmap bits.
+void remove_block(header *hdr) {
+    listnode *node = header_to_node(hdr);
+    if (node->prev == NULL) {
+        int fl, sl;
+        mapping(get_size(hdr), &fl, &sl);
+        lists[fl][sl] = node->nxt;
+        if (node->nxt == NULL) {
+            sl_map[fl] &= ~(1U << sl);
+            if (sl_map[fl] == 0) fl_map &= ~(1UL << fl);
+        }
+    } else node->prev->nxt = node->nxt;
+    if (node->nxt != NULL) node->nxt->prev = node->prev;
+}
+
+/* This function writes the footer of a free block and tells the
+ * block after it that its left neighbor is now free.
+ */
+void mark_free(header *hdr) {
+    header *next = next_header(hdr);
+    if (get_size(hdr) > MIN_PAYLOAD) {
+        *(unsigned long *)((char *)next - FOOTER_SIZE) = get_size(hdr);
+    }
+    if ((void *)next == segment_end) return;
+    next->size &= ~(unsigned long)PREV_MIN;
+    next->size |= get_size(hdr) > MIN_PAYLOAD ? PREV_FREE : PREV_FREE | PREV_MIN;
+}
+
+//This function sets the allocated bit and updates the block after hdr.
+void mark_used(header *hdr) {
+    hdr->size |= USED_BIT;
+    header *next = next_header(hdr);
+    if ((void *)next != segment_end) next->size &= ~(unsigned long)(PREV_FREE | PREV_MIN);
+}
+
+/* This function merges the free block hdr (not on a list) with its
+ * free neighbors, which are taken off their lists, and returns the
+ * header of the merged block.
+ */
+header *coalesce(header *hdr) {
+    header *neighbor = next_header(hdr);
+    if ((void *)neighbor != segment_end && !is_used(neighbor)) {
+        remove_block(neighbor);
+        hdr->size += HEADER_SIZE + get_size(neighbor);
+        num_header--;
+        STAT(stats.coalesces++);
+    }
+    if (hdr->size & PREV_FREE) {
+        header *left = prev_header(hdr);
+        remove_block(left);
+        left->size += HEADER_SIZE + get_size(hdr);
+        num_header--;
+        STAT(stats.coalesces++);
+        hdr = left;
+    }
+    return hdr;
+}
+
+/* This function gives the tail of hdr beyond needed bytes back to
+ * the lists, if it is big enough to be a block of its own.
+ */
+void split_block(header *hdr, size_t needed) {
+    size_t size = get_size(hdr);
+    if (size - needed < MIN_BLOCK) return;
+    hdr->size = needed | (hdr->size & FLAG_BITS);
+    STAT(stats.splits++);
+
+    header *rest = next_header(hdr);
+    rest->size = size - needed - HEADER_SIZE;
+    num_header++;
+    rest = coalesce(rest);
+    mark_free(rest);
+    insert_block(rest);
+}
+
+//This function moves nused past hdr if the heap now reaches further.
+void note_reach(header *hdr) {
+    size_t reach = (char *)next_header(hdr) - (char *)segment_start;
+    if (reach > nused) nused = reach;
+}
+
+/*
+ * This must be called by a client before making any allocation
+ * requests. It turns the whole segment into one free block. The
+ * function returns true if initialization was successful, or
+ * false otherwise, and can be called again to reset the heap.
+ */
+bool heap_init(void *heap_start, size_t heap_size) {
+    if (heap_size < MIN_BLOCK) return false;
+
+    segment_size = heap_size & ~(unsigned long)(ALIGNMENT - 1);
+    segment_start = heap_start;
+    segment_end = (char *)segment_start + segment_size;
+
+    memset(lists, 0, sizeof(lists));
+    memset(sl_map, 0, sizeof(sl_map));
+    fl_map = 0;
+    nbytes_inuse = 0;
+    num_header = 1;
+    nused = 0;
+    memset(&stats, 0, sizeof(stats));
+
+    header *first = (header *)segment_start;
+    first->size = segment_size - HEADER_SIZE;
+    mark_free(first);
+    insert_block(first);
+    return true;
+}
+
+/* This function allocates a block of at least requested_size bytes.
+ * The bitmaps lead straight to a list whose head fits, so the cost
+ * is the same whatever the state of the heap. Returns NULL if the
+ * request is invalid or there is no block large enough.
+ */
+void *heap_malloc(size_t requested_size) {
+    if (requested_size == 0 || requested_size > MAX_REQUEST_SIZE) return NULL;
+    size_t needed = addpad(requested_size, ALIGNMENT);
+    if (needed < MIN_PAYLOAD) needed = MIN_PAYLOAD;
+
+    header *hdr = find_suitable(needed);
+    if (hdr == NULL) return NULL;
+    remove_block(hdr);
+    split_block(hdr, needed);
+    nbytes_inuse += get_size(hdr);
+    STAT(stats_note_in_use(&stats, nbytes_inuse));
+    note_reach(hdr);
+    mark_used(hdr);
+    return (char *)hdr + HEADER_SIZE;
+}
+
+/*
+ * Frees the block at ptr, merging it with free neighbors on both
+ * sides. If a null pointer is taken in, we simply return.
+ */
+void heap_free(void *ptr) {
+    if (!ptr) return;
+    header *hdr = (header *)((char *)ptr - HEADER_SIZE);
+    hdr->size &= ~(unsigned long)USED_BIT;
+    nbytes_inuse -= get_size(hdr);
+
+    hdr = coalesce(hdr);
+    mark_free(hdr);
+    insert_block(hdr);
+}
+
+/* This function reallocates memory given a new size. Shrinking
+ * splits off the tail and growing first tries the free block to
+ * the right; only if that is not enough is the data moved.
+ */
+void *heap_realloc(void *old_ptr, size_t new_size) {
+    if (!old_ptr) return heap_malloc(new_size);
+    if (new_size == 0) {
+        heap_free(old_ptr);
+        return NULL;
+    }
+    if (new_size > MAX_REQUEST_SIZE) return NULL;
+    header *hdr = (header *)((char *)old_ptr - HEADER_SIZE);
+    size_t old_size = get_size(hdr);
+    size_t needed = addpad(new_size, ALIGNMENT);
+    if (needed < MIN_PAYLOAD) needed = MIN_PAYLOAD;
+
+    header *neighbor = next_header(hdr);
+    if (needed > old_size && (void *)neighbor != segment_end && !is_used(neighbor) &&
+        old_size + HEADER_SIZE + get_size(neighbor) >= needed) {
+        remove_block(neighbor);
+        hdr->size += HEADER_SIZE + get_size(neighbor);
+        num_header--;
+        mark_used(hdr);
+    }
+    if (get_size(hdr) >= needed) {
+        split_block(hdr, needed);
+        nbytes_inuse += get_size(hdr) - old_size;
+        STAT(stats_note_in_use(&stats, nbytes_inuse));
+        STAT(stats.realloc_in_place++);
+        note_reach(hdr);
+        return old_ptr;
+    }
+
+    void *new_ptr = heap_malloc(new_size);
+    if (!new_ptr) return NULL;
+    memcpy(new_ptr, old_ptr, old_size);
+    heap_free(old_ptr);
+    STAT(stats.realloc_moved++);
+    STAT(stats.realloc_copied += old_size);
+    return new_ptr;
+}
+
+/* The functions below are the allocator.h interface. Each one takes
+ * heap_lock around the matching heap_ function, so the heap can be
+ * shared between threads.
+ */
+bool myinit(void *heap_start, size_t heap_size) {
+    pthread_mutex_lock(&heap_lock);
+    bool ok = heap_init(heap_start, heap_size);
+    pthread_mutex_unlock(&heap_lock);
+    return ok;
+}
+
+void *mymalloc(size_t requested_size) {
+    pthread_mutex_lock(&heap_lock);
+    void *ptr = heap_malloc(requested_size);
+    STAT(stats_count(&stats, &stats.mallocs, requested_size, ptr == NULL));
+    pthread_mutex_unlock(&heap_lock);
+    return ptr;
+}
+
+void myfree(void *ptr) {
+    pthread_mutex_lock(&heap_lock);
+    heap_free(ptr);
+    STAT(if (ptr != NULL) stats.frees++);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void *myrealloc(void *old_ptr, size_t new_size) {
+    pthread_mutex_lock(&heap_lock);
+    void *ptr = heap_realloc(old_ptr, new_size);
+    STAT(stats_count(&stats, !old_ptr ? &stats.mallocs : new_size == 0 ? &stats.frees : &stats.reallocs,
+                     new_size, ptr == NULL && new_size != 0));
+    pthread_mutex_unlock(&heap_lock);
+    return ptr;
+}
+
+bool mystats(heap_stats *out) {
+    pthread_mutex_lock(&heap_lock);
+    *out = stats;
+    out->bytes_in_use = nbytes_inuse;
+    out->peak_footprint = nused;
+    out->num_blocks = num_header;
+    pthread_mutex_unlock(&heap_lock);
+    return STATS_ENABLED;
+}
+
+bool validate_heap() {
+    pthread_mutex_lock(&heap_lock);
+    bool ok = check_heap();
+    pthread_mutex_unlock(&heap_lock);
+    return ok;
+}
+
+/*
+ * Return true if all is ok, or false otherwise. Walks every block
+ * checking flag bits and footers, then every list checking that its
+ * blocks belong there and that the bitmaps agree with the lists.
+ */
+bool check_heap(void) {
+    int num_free_hdr = 0;
+    size_t payload = 0;
+    bool prev_free = false;
+    bool prev_min = false;
+    header *cur = (header *)segment_start;
+    for (int i = 0; i < num_header; i++) {
+        if ((void *)cur >= segment_end) {
+            printf("Oops! Address is not within heap bounds.\n");
+            breakpoint();
+            return false;
+        }
+        if (prev_free != ((cur->size & PREV_FREE) != 0) ||
+            prev_min != ((cur->size & PREV_MIN) != 0)) {
+            printf("Oops! Prev-free bits of header %p are wrong.\n", cur);
+            breakpoint();
+            return false;
+        }
+        if (is_used(cur)) {
+            payload += get_size(cur);
+        } else {
+            if (prev_free) {
+                printf("Oops! Two free blocks next to each other at %p.\n", cur);
+                breakpoint();
+                return false;
+            }
+            if (get_size(cur) > MIN_PAYLOAD &&
+                *(unsigned long *)((char *)next_header(cur) - FOOTER_SIZE) != get_size(cur)) {
+                printf("Oops! Footer of free block %p does not match its header.\n", cur);
+                breakpoint();
+                return false;
+            }
+            num_free_hdr++;
+        }
+        prev_free = !is_used(cur);
+        prev_min = prev_free && get_size(cur) == MIN_PAYLOAD;
+        cur = next_header(cur);
+    }
+    if ((void *)cur != segment_end) {
+        printf("Oops! Not all of the segment size is accounted for.\n");
+        breakpoint();
+        return false;
+    }
+    if (payload != nbytes_inuse) {
+        printf("Oops! Total payload bytes currently in use does not match sum of in-use block sizes.\n");
+        breakpoint();
+        return false;
+    }
+
+    int cnt = 0;
+    for (int fl = 0; fl < FL_COUNT; fl++) {
+        if ((sl_map[fl] != 0) != ((fl_map >> fl) & 1)) {
+            printf("Oops! fl_map does not match first level %d\n", fl);
+            breakpoint();
+            return false;
+        }
+        for (int sl = 0; sl < SL_COUNT; sl++) {
+            if ((lists[fl][sl] != NULL) != ((sl_map[fl] >> sl) & 1)) {
+                printf("Oops! sl_map does not match list %d/%d\n", fl, sl);
+                breakpoint();
+                return false;
+            }
+            listnode *prev = NULL;
+            for (listnode *node = lists[fl][sl]; node != NULL; node = node->nxt) {
+                header *hdr = node_to_header(node);
+                int f, s;
+                mapping(get_size(hdr), &f, &s);
+                if (is_used(hdr) || f != fl || s != sl || node->prev != prev) {
+                    printf("Oops! Free block %p is misplaced in list %d/%d\n", hdr, fl, sl);
+                    breakpoint();
+                    return false;
+                }
+                prev = node;
+                cnt++;
+            }
+        }
+    }
+    if (cnt != num_free_hdr) {
+        printf("Number of free headers does not match number of free list nodes\n");
+        breakpoint();
+        return false;
+    }
+    return true;
+}
+
+/* Used to print out each header and the non-empty lists.
+ */
+void dump_heap() {
+    printf("Heap segment starts at address %p, ends at %p. %lu bytes currently in use.\n",
+        segment_start, segment_end, nbytes_inuse);
+    header *cur = (header *)segment_start;
+    for (int i = 0; i < num_header; i++) {
+        printf("Header %d (%p): %lu\n", i, cur, cur->size);
+        cur = next_header(cur);
+    }
+    for (int fl = 0; fl < FL_COUNT; fl++) {
+        for (int sl = 0; sl < SL_COUNT; sl++) {
+            for (listnode *node = lists[fl][sl]; node != NULL; node = node->nxt) {
+                printf("List %d/%d node (%p): %p %p\n", fl, sl, node, node->prev, node->nxt);
+            }
+        }
+    }
+}